@@ -4,24 +4,22 @@
 /* Define structs and routine could be used by every source files */
 
 #include <stdint.h>
+#include <stddef.h>
 
-#define ADDRESS_SIZE	20
-#define OFFSET_LEN	10
-#define SEGMENT_LEN	5
-#define PAGE_LEN	5
-
-#define NUM_PAGES	(1 << (ADDRESS_SIZE - OFFSET_LEN))
-#define PAGE_SIZE	(1 << OFFSET_LEN)
+/* The sizes of memory, pages and address spaces are chosen when memory
+ * is initialized, see init_mem() */
+#define MAX_LEVELS	6	// Page table levels, at most
 
 typedef char BYTE;
-typedef uint32_t addr_t;
+typedef uint64_t addr_t;
 
 enum ins_opcode_t {
 	CALC,	// Just perform calculation, only use CPU
 	ALLOC,	// Allocate memory
 	FREE,	// Deallocated a memory block
 	READ,	// Write data to a byte on memory
-	WRITE	// Read data from a byte on memory
+	WRITE,	// Read data from a byte on memory
+	FORK	// Start a copy of the process, sharing its memory
 };
 
 /* instructions executed by the CPU */
@@ -35,25 +33,54 @@ struct inst_t {
 struct code_seg_t {
 	struct inst_t * text;
 	uint32_t size;
+	void * image;		// Mapped image backing [text], NULL if malloc'ed
+	size_t image_size;	// Length of the mapping
+	uint32_t ref;		// Processes sharing this segment
+	uint32_t bucket;	// Code cache chain of the loader holding it
 };
 
+/* Page tables form a tree of [levels] levels. The leaves are page
+ * tables, the other nodes segment tables, the root being a segment table
+ * of the first level. Tables are only allocated once a page in their range
+ * is mapped, and are sized by the geometry in use */
 struct page_table_t {
-	/* A row in the page table of the second layer */
-	struct  {
-		addr_t v_index; // The index of virtual address
+	int size;	// Number of valid rows
+	/* A row in the page table of the last level. Rows are indexed
+	 * directly by the last level index of the virtual address */
+	struct pte_t {
 		addr_t p_index; // The index of physical address
-	} table[1 << SEGMENT_LEN];
-	int size;
+		addr_t slot;	// Swap slot backing the page in swap mode
+		uint32_t valid : 1; // 1 if the row maps a page
+		uint32_t present : 1;	// 1 if the page is in [p_index]
+		uint32_t dirty : 1;	// Written since it was brought in
+		uint32_t accessed : 1;	// Used since the replacement
+					// policy last looked at it
+		uint32_t swapped : 1;	// [slot] holds the page content
+		uint32_t first : 1;	// First page of its region
+		uint32_t last : 1;	// Last page of its region
+		uint32_t huge : 1;	// Maps every page of the table, which
+					// then holds this row only
+		uint32_t cow : 1;	// Frame shared by FORK, copied before
+					// the first write
+	} table[];
 };
 
 /* Mapping virtual addresses and physical ones */
 struct seg_table_t {
-	/* Translation table for the first layer */
-	struct {
-		addr_t v_index;	// Virtual index
-		struct page_table_t * pages;
-	} table[1 << PAGE_LEN];
-	int size;	// Number of row in the first layer
+	int size;	// Number of tables allocated in the next level
+	/* Tables of the next level, indexed directly by the index of this
+	 * level in the virtual address. Segment tables, or page tables
+	 * below the last segment level. NULL if nothing in their range is
+	 * mapped */
+	void * table[];
+};
+
+/* Virtual addresses below the break pointer of a process which no
+ * region uses, kept in address order */
+struct vm_range_t {
+	addr_t start;
+	addr_t size;	// In bytes, a multiple of the page size
+	struct vm_range_t * next;
 };
 
 /* PCB, describe information about a process */
@@ -63,8 +90,19 @@ struct pcb_t {
 	struct code_seg_t * code;	// Code segment
 	addr_t regs[10]; // Registers, store address of allocated regions
 	uint32_t pc; // Program pointer, point to the next instruction
-	struct seg_table_t * seg_table; // Page table
-	uint32_t bp;	// Break pointer
+	struct seg_table_t * seg_table; // Page table, NULL until the first
+					// allocation
+	addr_t bp;	// Break pointer, 0 until the first allocation
+	struct vm_range_t * free_ranges; // Freed space below [bp]
+	uint32_t level;	// Queue level under the MLFQ policy
+	uint64_t vruntime; // Weighted CPU time under the CFS policy
+	uint64_t runtime;  // Time slots spent on a CPU so far
+	uint64_t dispatch_time; // Time slot of the last dispatch
+	int last_cpu;	// CPU it last ran on, -1 if it has not run yet
+	uint32_t migrations; // Times it moved to another CPU
+	uint64_t arrival_time;	// Time slot it was added to a run queue
+	uint64_t first_dispatch; // Time slot it first ran, UINT64_MAX if not
+	uint32_t preemptions;	// Times it was put back to a run queue
 };
 
 #endif
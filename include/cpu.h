@@ -9,5 +9,11 @@
  * Otherwise, return 1. */
 int run(struct pcb_t * proc);
 
+/* Hand every process created by FORK to [handler], along with the process
+ * which forked it, e.g. to add it to a run queue. FORK fails until a
+ * handler is set */
+void set_spawn_handler(
+	void (*handler)(struct pcb_t * parent, struct pcb_t * child));
+
 #endif
 
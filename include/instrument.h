@@ -0,0 +1,88 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+/* Hot path counters, only built with -DINSTRUMENT (make INSTRUMENT=1
+ * after a make clean). Each thread counts into a private block and
+ * instrument_report() sums the blocks at exit. Without INSTRUMENT the
+ * macros below expand to nothing, or to plain pthread calls for locks */
+
+#include "common.h"
+#include <pthread.h>
+#include <stdint.h>
+
+enum counter_id_t {
+	CNT_ALLOCS,		// alloc_mem() calls
+	CNT_FREE_MAP_WORDS,	// Free map words scanned for free frames
+	CNT_HUGE_PAGES,		// Huge pages mapped by alloc_mem()
+	CNT_COW_COPIES,		// Shared pages copied on write
+	CNT_TRANSLATIONS,	// Page table walks
+	CNT_TRANSLATE_PROBES,	// Table entries read by page table walks
+	CNT_READ_FAILS,
+	CNT_WRITE_FAILS,
+	CNT_OPCODE,		// Instructions run, one counter per opcode
+	NUM_COUNTERS = CNT_OPCODE + FORK + 1
+};
+
+enum lock_kind_t {
+	LOCK_ZONE,	// Free frame zones
+	LOCK_MAGAZINE,	// Per-CPU frame caches
+	LOCK_QUEUE,	// Run queues
+	NUM_LOCK_KINDS
+};
+
+#ifdef INSTRUMENT
+
+struct counters_t {
+	uint64_t count[NUM_COUNTERS];
+	uint64_t locks[NUM_LOCK_KINDS];
+	uint64_t wait_ns[NUM_LOCK_KINDS];
+	uint64_t hold_ns[NUM_LOCK_KINDS];
+	uint64_t acquired[NUM_LOCK_KINDS];	// When the lock was taken
+	struct counters_t * next;
+};
+
+extern __thread struct counters_t * _counters;
+
+/* Give the calling thread its block of counters */
+struct counters_t * attach_counters(void);
+
+uint64_t instrument_clock(void);
+
+static inline struct counters_t * counters(void) {
+	struct counters_t * c = _counters;
+	return c != NULL ? c : attach_counters();
+}
+
+static inline void counted_lock(pthread_mutex_t * m, enum lock_kind_t k) {
+	struct counters_t * c = counters();
+	uint64_t start = instrument_clock();
+	pthread_mutex_lock(m);
+	c->acquired[k] = instrument_clock();
+	c->wait_ns[k] += c->acquired[k] - start;
+	c->locks[k]++;
+}
+
+static inline void counted_unlock(pthread_mutex_t * m, enum lock_kind_t k) {
+	struct counters_t * c = counters();
+	c->hold_ns[k] += instrument_clock() - c->acquired[k];
+	pthread_mutex_unlock(m);
+}
+
+#define COUNT(id, n)	(counters()->count[id] += (n))
+#define LOCK(m, kind)	counted_lock(m, kind)
+#define UNLOCK(m, kind)	counted_unlock(m, kind)
+
+/* Print the sum of every thread's counters to stderr */
+void instrument_report(void);
+
+#else
+
+#define COUNT(id, n)
+#define LOCK(m, kind)	pthread_mutex_lock(m)
+#define UNLOCK(m, kind)	pthread_mutex_unlock(m)
+#define instrument_report()
+
+#endif
+
+#endif
+
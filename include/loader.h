@@ -3,7 +3,35 @@
 
 #include "common.h"
 
+/* A process description is either the text format of input/proc/ or a
+ * compiled image: an image_header_t followed by [size] inst_t records
+ * in the byte order of the machine which compiled it. load() tells them
+ * apart by the magic number */
+#define IMAGE_MAGIC	0x4d49534fU	// "OSIM"
+#define IMAGE_VERSION	2	// 2: FORK opcode
+
+struct image_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t priority;
+	uint32_t size;	// Number of instructions
+};
+
+/* Create a process running the program at [path]. Processes loaded from
+ * the same path share one read-only code segment */
 struct pcb_t * load(const char * path);
 
-#endif
+/* Create a process running the code of [proc] from where it is, with a
+ * copy of its registers. Its address space is left empty for
+ * fork_mem() */
+struct pcb_t * clone_proc(const struct pcb_t * proc);
 
+/* Drop a process's reference to its code segment. The segment is
+ * unmapped or freed once no process uses it */
+void release_code(struct code_seg_t * code);
+
+/* Compile the text process description at [src] into an image at [dst].
+ * Return 0 on success. Otherwise, print the reason and return 1 */
+int compile_image(const char * src, const char * dst);
+
+#endif
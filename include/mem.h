@@ -3,10 +3,34 @@
 
 #include "common.h"
 
-#define RAM_SIZE	(1 << ADDRESS_SIZE)
+/* Sizes of the simulated machine. Virtual addresses have [address_bits]
+ * bits: a page offset below [levels] table indexes which share the
+ * remaining bits, the first level taking what is left over */
+struct mem_geometry_t {
+	uint64_t ram_size;	// Bytes of physical memory
+	uint32_t page_size;	// A power of two
+	int address_bits;	// Up to 48
+	int levels;		// 2 to MAX_LEVELS
+};
 
-/* Init related parameters, must be called before being used */
-void init_mem(void);
+/* The original machine: 1 MiB of RAM, 1 KiB pages and 20-bit virtual
+ * addresses translated with 2 levels of 5 bits */
+#define DEFAULT_RAM_SIZE	(1 << 20)
+#define DEFAULT_PAGE_SIZE	(1 << 10)
+#define DEFAULT_ADDRESS_BITS	20
+#define DEFAULT_LEVELS		2
+
+/* Init related parameters with [geometry], or the default one if it is
+ * NULL. Must be called before being used */
+void init_mem(const struct mem_geometry_t * geometry);
+
+/* Geometry in use */
+const struct mem_geometry_t * mem_geometry(void);
+
+/* Bind the calling thread to simulated CPU [cpu]: it gets its own cache
+ * of free frames and its own TLB. Threads that never call this (e.g. the
+ * mem test program) allocate straight from the shared frame pool */
+void attach_mem(int cpu);
 
 /* Allocate [size] bytes for process [proc] and return its virtual address.
  * If we cannot allocate new memory region for this process, return 0 */
@@ -25,8 +49,39 @@ int read_mem(addr_t address, struct pcb_t * proc, BYTE * data);
  * [proc]. If given [address] is valid, return 0. Otherwise, return 1 */
 int write_mem(addr_t address, struct pcb_t * proc, BYTE data);
 
+/* Give [child], a copy of [parent] made by FORK, the same address space.
+ * Frames are shared read-only and copied on the first write of either
+ * process. Return 0 on success, 1 if swap is on, which FORK does not
+ * support */
+int fork_mem(struct pcb_t * parent, struct pcb_t * child);
+
+/* Give back everything [proc] holds in memory: frames, swap slots, page
+ * tables and TLB entries. Called once the process has finished */
+void release_mem(struct pcb_t * proc);
+
+/* Number of frames owned by process [pid], or by any process if [pid]
+ * is 0 */
+uint32_t owned_frames(uint32_t pid);
+
 void dump(void);
 
+/* Page replacement policies of swap mode */
+enum swap_policy_t {
+	SWAP_FIFO,	// Evict the page brought in first
+	SWAP_CLOCK,	// FIFO, but give recently used pages a second chance
+	SWAP_LRU	// Evict the page with the lowest aging counter
+};
+
+/* Back memory with [slots] pages of swap space in the file at [path].
+ * Allocations then reserve swap slots instead of frames and pages are
+ * only brought into frames when they are used, evicting others with
+ * [policy] when no frame is free. Must be called after init_mem() and
+ * before any allocation */
+void init_swap(const char * path, int slots, enum swap_policy_t policy);
+
+/* Print page fault and eviction counters to stderr if swap is on */
+void swap_report(void);
+
 #endif
 
 
@@ -0,0 +1,26 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+/* Scheduling metrics. The scheduler reports the life cycle of every
+ * process here, and the time CPUs spend running them */
+
+void init_metrics(int num_cpus);
+
+/* [proc] has been added to a run queue for the first time */
+void metrics_arrive(struct pcb_t * proc);
+
+/* [proc] has been dispatched on CPU [cpu] */
+void metrics_dispatch(struct pcb_t * proc, int cpu);
+
+/* [proc] has left CPU [cpu], back to a run queue if [finished] is 0 */
+void metrics_leave(struct pcb_t * proc, int cpu, int finished);
+
+/* Print turnaround, waiting and response times, throughput and CPU
+ * utilisation to stderr. If [path] is not NULL, also write them there,
+ * as JSON if it ends with ".json" and as CSV otherwise */
+void finish_metrics(const char * path);
+
+#endif
+
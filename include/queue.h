@@ -4,17 +4,43 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
+#define INIT_QUEUE_SIZE 16
+#define AFFINITY_WINDOW 8
+
+/* Which process of a queue comes out first. Ties are always broken in
+ * the order processes were put in */
+enum queue_order_t {
+	BY_PRIORITY,	// Highest [priority]
+	BY_ARRIVAL,	// Plain FIFO
+	BY_VRUNTIME	// Lowest [vruntime]
+};
 
+/* Priority queue of processes, kept as a binary heap. The queue grows
+ * as needed */
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
+	struct queue_entry_t {
+		struct pcb_t * proc;
+		uint64_t seq; // Enqueue order, breaks ties between priorities
+	} * heap;
 	int size;
+	int capacity;
+	uint64_t seq;
+	enum queue_order_t order;
 };
 
+/* Init an empty queue ordered by priority */
+void init_queue(struct queue_t * q);
+
+void init_queue_by(struct queue_t * q, enum queue_order_t order);
+
 void enqueue(struct queue_t * q, struct pcb_t * proc);
 
 struct pcb_t * dequeue(struct queue_t * q);
 
+/* Like dequeue(), but among the first AFFINITY_WINDOW processes ranked
+ * equal to the head of [q], prefer one which last ran on CPU [cpu] */
+struct pcb_t * dequeue_affine(struct queue_t * q, int cpu);
+
 int empty(struct queue_t * q);
 
 #endif
@@ -1,22 +1,68 @@
-#ifndef QUEUE_H
-#define QUEUE_H
+#ifndef SCHED_H
+#define SCHED_H
 
 #include "common.h"
 
+#define MLFQ_MAX_LEVELS	8
+
+enum sched_policy_id_t {
+	SCHED_PRIO,	// Static priority, ready/run queue pair
+	SCHED_MLFQ,	// Multilevel feedback queue
+	SCHED_CFS	// Fair share by weighted virtual runtime
+};
+
+/* How the scheduler is set up, normally read from the configure file */
+struct sched_config_t {
+	int num_cpus;
+	int per_cpu;	// 1: each CPU has its own run queue, 0: one shared
+	enum sched_policy_id_t policy;
+	int time_slot;	// Time slice of the static priority policy
+	/* MLFQ: a process starts in level 0, and drops one level each
+	 * time it uses up the quantum of its level. Every [mlfq_boost]
+	 * time slots, every queued process goes back to level 0 */
+	int mlfq_levels;
+	int mlfq_quantum[MLFQ_MAX_LEVELS];
+	int mlfq_boost;
+	/* CFS: every runnable process should get a turn within
+	 * [cfs_latency] time slots, in proportion to its weight
+	 * (priority + 1), but no turn is shorter than [cfs_granularity] */
+	int cfs_latency;
+	int cfs_granularity;
+	/* Time slots a CPU stalls when it runs a process which last ran
+	 * on another CPU */
+	int migration_cost;
+};
+
 int queue_empty(void);
 
-void init_scheduler(void);
+void init_scheduler(struct sched_config_t * config);
+
+/* Print scheduler statistics, including the share of CPU time each
+ * process got, to stderr */
 void finish_scheduler(void);
 
-/* Get the next process from ready queue */
-struct pcb_t * get_proc(void);
+/* Get the next process CPU [cpu] should run */
+struct pcb_t * get_proc(int cpu);
 
-/* Put a process back to run queue */
-void put_proc(struct pcb_t * proc);
+/* Record that [proc] is dispatched on CPU [cpu] and return the number
+ * of time slots the CPU must stall first if [proc] comes from another
+ * CPU. The stall is not charged to [proc] */
+int dispatch_penalty(struct pcb_t * proc, int cpu);
+
+/* Number of time slots [proc], just dispatched on CPU [cpu], may run
+ * before it is put back */
+int time_slice(struct pcb_t * proc, int cpu);
+
+/* Put a process which has used up its time slice on CPU [cpu] back to
+ * run queue */
+void put_proc(struct pcb_t * proc, int cpu);
 
 /* Add a new process to ready queue */
 void add_proc(struct pcb_t * proc);
 
-#endif
+/* Tell the scheduler that [proc], running on CPU [cpu], has finished.
+ * It must not be used by the scheduler afterward */
+void finish_proc(struct pcb_t * proc, int cpu);
 
+#endif
 
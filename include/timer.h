@@ -4,13 +4,11 @@
 #include <pthread.h>
 #include <stdint.h>
 
+/* A device (CPU or loader) taking part in the time slot barrier */
 struct timer_id_t {
-	int done;
-	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	int fsh;	// Set once the device is detached
+	uint64_t resume;	// Slot a sleeping device waits for, else 0
+	uint32_t wake;	// Bumped when a sleeping device is released
 };
 
 void start_timer();
@@ -21,8 +19,19 @@ struct timer_id_t * attach_event();
 
 void detach_event(struct timer_id_t * event);
 
+/* The device has done its job in the current slot and has more to do in
+ * the next one */
 void next_slot(struct timer_id_t* timer_id);
 
+/* The device had nothing to do in the current slot. When every device
+ * is idle or sleeping, time jumps straight to the earliest slot a
+ * sleeping device waits for */
+void idle_slot(struct timer_id_t* timer_id);
+
+/* The device has nothing to do before slot [time]. Return once
+ * current_time() reaches it */
+void sleep_until(struct timer_id_t* timer_id, uint64_t time);
+
 uint64_t current_time();
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include "common.h"
+
+#define TLB_DEFAULT_ENTRIES	64
+#define TLB_DEFAULT_WAYS	4
+
+/* Set the geometry of every TLB created afterward. [entries] must be a
+ * multiple of [ways] and [entries] / [ways] a power of two. 0 entries
+ * disables the TLB. Must be called before any CPU attaches to a TLB */
+void init_tlb(int entries, int ways);
+
+/* Give the calling thread a private TLB on behalf of CPU [cpu]. Threads
+ * without a TLB always walk the page tables */
+void tlb_attach(int cpu);
+
+/* Look up the frame mapping virtual page [vpn] of process [pid] in the
+ * TLB of the calling thread, for a write if [write] is set. Return 1 and
+ * write it to [frame] on hit. Otherwise, return 0. Writes miss on pages
+ * cached read-only */
+int tlb_lookup(uint32_t pid, addr_t vpn, addr_t * frame, int write);
+
+/* Cache the translation [vpn] -> [frame] of process [pid] in the TLB of
+ * the calling thread, replacing any older one of [vpn] */
+void tlb_insert(uint32_t pid, addr_t vpn, addr_t frame, int writable);
+
+/* Drop the translation of page [vpn] of process [pid] from all TLBs */
+void tlb_invalidate(uint32_t pid, addr_t vpn);
+
+/* Drop every translation of process [pid] from all TLBs */
+void tlb_flush(uint32_t pid);
+
+/* Print hit/miss counters of each TLB to stderr */
+void tlb_report(void);
+
+#endif
+
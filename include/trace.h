@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Events of the simulation. Threads append them to private ring buffers
+ * and a drain thread writes them out in the order they happened, so no
+ * thread waits on stdout */
+enum trace_type_t {
+	TRACE_SLOT,	// Time slots [time] to [arg] have started
+	TRACE_LOAD,	// The loader added process [pid] from [arg]
+	TRACE_DISPATCH,
+	TRACE_PUT,
+	TRACE_FINISH,
+	TRACE_STOP,	// CPU [cpu] has stopped
+	TRACE_FORK	// Process [pid] on CPU [cpu] has forked process [arg]
+};
+
+/* A trace record. The binary trace file is a trace_file_header_t
+ * followed by records, each TRACE_LOAD record followed by the [arg]
+ * bytes of its path */
+struct trace_rec_t {
+	uint64_t seq;	// Global order of events
+	uint64_t time;	// Time slot the event happened in
+	uint64_t arg;
+	uint32_t pid;
+	uint16_t cpu;
+	uint16_t type;
+};
+
+#define TRACE_MAGIC	0x5254534fU	// "OSTR"
+#define TRACE_VERSION	1
+
+struct trace_file_header_t {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* Start the drain thread. Records are rendered as text on stdout, or
+ * written in binary form to [path] if it is not NULL */
+void start_trace(const char * path);
+
+/* Write every remaining record and stop the drain thread. Strings
+ * passed to trace_load() must stay valid until then */
+void stop_trace(void);
+
+/* Time slots [first] to [last] have started */
+void trace_slots(uint64_t first, uint64_t last);
+
+/* Record a CPU event about process [pid] */
+void trace_event(enum trace_type_t type, int cpu, uint32_t pid);
+
+/* Process [pid] running on CPU [cpu] has forked process [child] */
+void trace_fork(int cpu, uint32_t pid, uint32_t child);
+
+/* The process [pid] loaded from [path] has arrived */
+void trace_load(uint32_t pid, const char * path);
+
+#endif
+
@@ -1,6 +1,16 @@
 
 #include "cpu.h"
+#include "instrument.h"
+#include "loader.h"
 #include "mem.h"
+#include <stdlib.h>
+
+static void (*spawn)(struct pcb_t * parent, struct pcb_t * child) = NULL;
+
+void set_spawn_handler(
+		void (*handler)(struct pcb_t * parent, struct pcb_t * child)) {
+	spawn = handler;
+}
 
 static int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -44,6 +54,20 @@ static int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
+static int fork_proc(struct pcb_t * proc) {
+	if (spawn == NULL) {
+		return 1;
+	}
+	struct pcb_t * child = clone_proc(proc);
+	if (fork_mem(proc, child)) {
+		release_code(child->code);
+		free(child);
+		return 1;
+	}
+	spawn(proc, child);
+	return 0;
+}
+
 int run(struct pcb_t * proc) {
 	/* Check if Program Counter point to the proper instruction */
 	if (proc->pc >= proc->code->size) {
@@ -52,6 +76,11 @@ int run(struct pcb_t * proc) {
 	
 	struct inst_t ins = proc->code->text[proc->pc];
 	proc->pc++;
+	/* Images are not checked when loaded */
+	if ((uint32_t)ins.opcode > FORK) {
+		return 1;
+	}
+	COUNT(CNT_OPCODE + ins.opcode, 1);
 	int stat = 1;
 	switch (ins.opcode) {
 	case CALC:
@@ -69,6 +98,9 @@ int run(struct pcb_t * proc) {
 	case WRITE:
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 		break;
+	case FORK:
+		stat = fork_proc(proc);
+		break;
 	default:
 		stat = 1;
 	}
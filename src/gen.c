@@ -0,0 +1,259 @@
+
+/* Synthetic workload generator. Writes a configure file input/<name>
+ * and the programs of its processes to input/proc/<name>/, so that
+ * "./os <name>" runs the workload */
+
+#include "common.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NUM_REGS	10
+
+enum arrival_t {UNIFORM, POISSON, BURST};
+
+static struct {
+	const char * name;
+	int num_procs;
+	int num_cpus;
+	int time_slot;
+	int length;		// Instructions per program
+	enum arrival_t arrival;
+	double gap;		// Mean time slots between arrivals
+	int burst;		// Processes per burst
+	int prio_lo, prio_hi;
+	int mix[FORK + 1];	// Relative weight of each opcode
+	int size_lo, size_hi;	// Bytes per allocation
+	uint64_t seed;
+} opt = {
+	"gen", 16, 4, 2, 20, POISSON, 2.0, 4, 0, 20,
+	{60, 10, 10, 10, 10, 0}, 128, 8192, 1
+};
+
+/* xorshift64*, so workloads are reproducible from their seed */
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [lo, hi] */
+static int rng_range(int lo, int hi) {
+	return lo + (int)(rng() % (uint64_t)(hi - lo + 1));
+}
+
+/* Uniform in (0, 1] */
+static double rng_unit(void) {
+	return ((rng() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static enum ins_opcode_t pick_opcode(void) {
+	int total = 0, i;
+	for (i = 0; i <= FORK; i++) {
+		total += opt.mix[i];
+	}
+	int r = rng_range(1, total);
+	for (i = 0; i < FORK; i++) {
+		if ((r -= opt.mix[i]) <= 0) {
+			break;
+		}
+	}
+	return (enum ins_opcode_t)i;
+}
+
+/* Write a program which only frees, reads and writes regions it has
+ * allocated, and only inside them */
+static void write_program(FILE * file) {
+	uint32_t size[NUM_REGS] = {0};	// Size of the region in each register
+	fprintf(file, "%d %d\n", rng_range(opt.prio_lo, opt.prio_hi),
+		opt.length);
+	int i;
+	for (i = 0; i < opt.length; i++) {
+		int reg = rng_range(0, NUM_REGS - 1);
+		int used = -1, r;
+		for (r = 0; r < NUM_REGS; r++) {
+			int k = (reg + r) % NUM_REGS;
+			if (size[k] > 0) {
+				used = k;
+				break;
+			}
+		}
+		enum ins_opcode_t op = pick_opcode();
+		if (op != CALC && op != ALLOC && op != FORK && used < 0) {
+			op = ALLOC;
+		}
+		switch (op) {
+		case CALC:
+			fprintf(file, "calc\n");
+			break;
+		case ALLOC:
+			if (size[reg] > 0) {
+				/* Do not leak the region it holds */
+				fprintf(file, "free %d\n", reg);
+				size[reg] = 0;
+				break;
+			}
+			size[reg] = rng_range(opt.size_lo, opt.size_hi);
+			fprintf(file, "alloc %u %d\n", size[reg], reg);
+			break;
+		case FREE:
+			fprintf(file, "free %d\n", used);
+			size[used] = 0;
+			break;
+		case READ:
+			/* Read into a register which holds no region if
+			 * there is one */
+			for (r = 0; r < NUM_REGS && size[reg] > 0; r++) {
+				reg = (reg + 1) % NUM_REGS;
+			}
+			fprintf(file, "read %d %d %d\n", used,
+				rng_range(0, size[used] - 1), reg);
+			size[reg] = 0;
+			break;
+		case WRITE:
+			fprintf(file, "write %d %d %d\n", rng_range(1, 255),
+				used, rng_range(0, size[used] - 1));
+			break;
+		case FORK:
+			fprintf(file, "fork\n");
+			break;
+		}
+	}
+}
+
+static void usage(void) {
+	printf("Usage: gen [options]\n"
+		"\t-o name\t\tworkload name (gen)\n"
+		"\t-n procs\tnumber of processes (16)\n"
+		"\t-c cpus\t\tnumber of CPUs (4)\n"
+		"\t-t slot\t\ttime slot (2)\n"
+		"\t-l length\tinstructions per program (20)\n"
+		"\t-a uniform|poisson|burst\n"
+		"\t\t\tarrival process (poisson)\n"
+		"\t-g gap\t\tmean time slots between arrivals (2)\n"
+		"\t-b size\t\tprocesses per burst (4)\n"
+		"\t-p lo-hi\tpriority range (0-20)\n"
+		"\t-m c,a,f,r,w[,k]\tcalc/alloc/free/read/write/fork "
+			"weights (60,10,10,10,10,0)\n"
+		"\t-z lo-hi\tallocation size range in bytes (128-8192)\n"
+		"\t-s seed\t\trandom seed (1)\n");
+	exit(1);
+}
+
+static void make_dir(const char * path) {
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		printf("Cannot create directory %s\n", path);
+		exit(1);
+	}
+}
+
+int main(int argc, char * argv[]) {
+	int c;
+	while ((c = getopt(argc, argv, "o:n:c:t:l:a:g:b:p:m:z:s:")) != -1) {
+		switch (c) {
+		case 'o': opt.name = optarg; break;
+		case 'n': opt.num_procs = atoi(optarg); break;
+		case 'c': opt.num_cpus = atoi(optarg); break;
+		case 't': opt.time_slot = atoi(optarg); break;
+		case 'l': opt.length = atoi(optarg); break;
+		case 'g': opt.gap = atof(optarg); break;
+		case 'b': opt.burst = atoi(optarg); break;
+		case 's': opt.seed = strtoull(optarg, NULL, 0); break;
+		case 'a':
+			if (!strcmp(optarg, "uniform")) {
+				opt.arrival = UNIFORM;
+			}else if (!strcmp(optarg, "poisson")) {
+				opt.arrival = POISSON;
+			}else if (!strcmp(optarg, "burst")) {
+				opt.arrival = BURST;
+			}else{
+				usage();
+			}
+			break;
+		case 'p':
+			if (sscanf(optarg, "%d-%d", &opt.prio_lo,
+					&opt.prio_hi) != 2) {
+				usage();
+			}
+			break;
+		case 'z':
+			if (sscanf(optarg, "%d-%d", &opt.size_lo,
+					&opt.size_hi) != 2) {
+				usage();
+			}
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d,%d,%d,%d,%d,%d", &opt.mix[CALC],
+					&opt.mix[ALLOC], &opt.mix[FREE],
+					&opt.mix[READ], &opt.mix[WRITE],
+					&opt.mix[FORK]) < 5) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (opt.num_procs < 1 || opt.num_cpus < 1 || opt.time_slot < 1
+			|| opt.length < 1 || opt.burst < 1 || opt.gap < 0
+			|| opt.prio_lo > opt.prio_hi || opt.size_lo < 1
+			|| opt.size_lo > opt.size_hi
+			|| opt.mix[0] + opt.mix[1] + opt.mix[2] + opt.mix[3]
+				+ opt.mix[4] + opt.mix[5] < 1) {
+		usage();
+	}
+	rng_state = opt.seed ? opt.seed : 1;
+
+	char path[256];
+	snprintf(path, sizeof(path), "input/%s", opt.name);
+	FILE * config = fopen(path, "w");
+	if (config == NULL) {
+		printf("Cannot create configure file %s\n", path);
+		return 1;
+	}
+	fprintf(config, "%d %d %d\n", opt.time_slot, opt.num_cpus,
+		opt.num_procs);
+	snprintf(path, sizeof(path), "input/proc/%s", opt.name);
+	make_dir(path);
+
+	double now = 0;
+	int i;
+	for (i = 0; i < opt.num_procs; i++) {
+		if (i > 0) {
+			switch (opt.arrival) {
+			case UNIFORM:
+				now += opt.gap * 2 * rng_unit();
+				break;
+			case POISSON:
+				now += -log(rng_unit()) * opt.gap;
+				break;
+			case BURST:
+				if (i % opt.burst == 0) {
+					now += opt.gap * opt.burst;
+				}
+				break;
+			}
+		}
+		fprintf(config, "%lu %s/p%d\n", (unsigned long)now,
+			opt.name, i);
+		snprintf(path, sizeof(path), "input/proc/%s/p%d",
+			opt.name, i);
+		FILE * program = fopen(path, "w");
+		if (program == NULL) {
+			printf("Cannot create program %s\n", path);
+			return 1;
+		}
+		write_program(program);
+		fclose(program);
+	}
+	fclose(config);
+	return 0;
+}
+
@@ -0,0 +1,91 @@
+
+#include "instrument.h"
+
+#ifdef INSTRUMENT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+__thread struct counters_t * _counters = NULL;
+
+/* Blocks of every thread, kept after the thread exits */
+static struct counters_t * _list = NULL;
+static pthread_mutex_t _list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char * counter_name[CNT_OPCODE] = {
+	"alloc_mem calls",
+	"free map words scanned",
+	"huge pages mapped",
+	"pages copied on write",
+	"page table walks",
+	"page table entries probed",
+	"read_mem failures",
+	"write_mem failures"
+};
+
+static const char * opcode_name[FORK + 1] = {
+	"calc", "alloc", "free", "read", "write", "fork"
+};
+
+static const char * lock_name[NUM_LOCK_KINDS] = {
+	"zone", "magazine", "run queue"
+};
+
+struct counters_t * attach_counters(void) {
+	struct counters_t * c =
+		(struct counters_t*)calloc(1, sizeof(struct counters_t));
+	pthread_mutex_lock(&_list_lock);
+	c->next = _list;
+	_list = c;
+	pthread_mutex_unlock(&_list_lock);
+	_counters = c;
+	return c;
+}
+
+uint64_t instrument_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void instrument_report(void) {
+	struct counters_t sum = {{0}};
+	struct counters_t * c;
+	int i;
+	pthread_mutex_lock(&_list_lock);
+	for (c = _list; c != NULL; c = c->next) {
+		for (i = 0; i < NUM_COUNTERS; i++) {
+			sum.count[i] += c->count[i];
+		}
+		for (i = 0; i < NUM_LOCK_KINDS; i++) {
+			sum.locks[i] += c->locks[i];
+			sum.wait_ns[i] += c->wait_ns[i];
+			sum.hold_ns[i] += c->hold_ns[i];
+		}
+	}
+	pthread_mutex_unlock(&_list_lock);
+
+	fprintf(stderr, "Instrumentation:\n");
+	for (i = 0; i < CNT_OPCODE; i++) {
+		fprintf(stderr, "\t%-26s %12lu\n", counter_name[i],
+			sum.count[i]);
+	}
+	if (sum.count[CNT_ALLOCS] > 0) {
+		fprintf(stderr, "\t%-26s %12.2f\n", "words scanned per alloc",
+			(double)sum.count[CNT_FREE_MAP_WORDS]
+				/ sum.count[CNT_ALLOCS]);
+	}
+	for (i = 0; i <= FORK; i++) {
+		fprintf(stderr, "\t%-26s %12lu\n", opcode_name[i],
+			sum.count[CNT_OPCODE + i]);
+	}
+	for (i = 0; i < NUM_LOCK_KINDS; i++) {
+		fprintf(stderr, "\t%s lock: %lu acquisitions, "
+			"%lu ns waited, %lu ns held\n", lock_name[i],
+			sum.locks[i], sum.wait_ns[i], sum.hold_ns[i]);
+	}
+}
+
+#endif
+
@@ -3,14 +3,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static uint32_t avail_pid = 1;
 
+/* Code segments currently in use, keyed by the path they were loaded
+ * from. Lookups come from the loader, releases from every CPU */
+#define CODE_CACHE_SIZE	64
+
+static struct code_cache_t {
+	char * path;
+	struct code_seg_t * code;
+	uint32_t priority;	// Priority recorded in the description
+	struct code_cache_t * next;
+} * code_cache[CODE_CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char * path) {
+	uint32_t h = 2166136261U;
+	while (*path) {
+		h = (h ^ (unsigned char)*path++) * 16777619U;
+	}
+	return h % CODE_CACHE_SIZE;
+}
+
 #define OPT_CALC	"calc"
 #define OPT_ALLOC	"alloc"
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_FORK	"fork"
 
 static enum ins_opcode_t get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
@@ -23,60 +47,50 @@ static enum ins_opcode_t get_opcode(char * opt) {
 		return READ;
 	} else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
+	} else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
 	} else{
 		printf("Opcode: %s\n", opt);
 		exit(1);
 	}
 }
 
-struct pcb_t * load(const char * path) {
-	/* Create new PCB for the new process */
-	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
-	proc->seg_table =
-		(struct seg_table_t*)malloc(sizeof(struct seg_table_t));
-	proc->bp = PAGE_SIZE;
-	proc->pc = 0;
-
-	/* Read process code from file */
-	FILE * file;
-	if ((file = fopen(path, "r")) == NULL) {
-		printf("Cannot find process description at '%s'\n", path);
-		exit(1);		
-	}
+/* Parse the text process description in [file] */
+static struct code_seg_t * read_text(FILE * file, uint32_t * priority) {
 	char opcode[10];
-	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
-	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
-	proc->code->text = (struct inst_t*)malloc(
-		sizeof(struct inst_t) * proc->code->size
+	struct code_seg_t * code =
+		(struct code_seg_t*)calloc(1, sizeof(struct code_seg_t));
+	fscanf(file, "%u %u", priority, &code->size);
+	code->text = (struct inst_t*)malloc(
+		sizeof(struct inst_t) * code->size
 	);
 	uint32_t i = 0;
-	for (i = 0; i < proc->code->size; i++) {
+	for (i = 0; i < code->size; i++) {
 		fscanf(file, "%s", opcode);
-		proc->code->text[i].opcode = get_opcode(opcode);
-		switch(proc->code->text[i].opcode) {
+		code->text[i].opcode = get_opcode(opcode);
+		switch(code->text[i].opcode) {
 		case CALC:
+		case FORK:
 			break;
 		case ALLOC:
 			fscanf(
 				file,
 				"%u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1
+				&code->text[i].arg_0,
+				&code->text[i].arg_1
 			);
 			break;
 		case FREE:
-			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			fscanf(file, "%u\n", &code->text[i].arg_0);
 			break;
 		case READ:
 		case WRITE:
 			fscanf(
 				file,
 				"%u %u %u\n",
-				&proc->code->text[i].arg_0,
-				&proc->code->text[i].arg_1,
-				&proc->code->text[i].arg_2
+				&code->text[i].arg_0,
+				&code->text[i].arg_1,
+				&code->text[i].arg_2
 			);
 			break;	
 		default:
@@ -84,8 +98,162 @@ struct pcb_t * load(const char * path) {
 			exit(1);
 		}
 	}
+	return code;
+}
+
+/* Map the compiled image opened as [file] read-only and point the code
+ * segment straight at its records, so nothing is parsed or copied. Pages
+ * are only touched when run, which fails on opcodes it does not know;
+ * compile_image() never writes those */
+static struct code_seg_t * map_image(FILE * file, const char * path,
+		const struct image_header_t * header, uint32_t * priority) {
+	struct stat st;
+	if (header->version != IMAGE_VERSION || fstat(fileno(file), &st)) {
+		printf("Unsupported process image at '%s'\n", path);
+		exit(1);
+	}
+	if ((uint64_t)st.st_size != sizeof(struct image_header_t) +
+			(uint64_t)header->size * sizeof(struct inst_t)) {
+		printf("Truncated process image at '%s'\n", path);
+		exit(1);
+	}
+	void * image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		fileno(file), 0);
+	if (image == MAP_FAILED) {
+		printf("Cannot map process image at '%s'\n", path);
+		exit(1);
+	}
+	struct code_seg_t * code =
+		(struct code_seg_t*)calloc(1, sizeof(struct code_seg_t));
+	code->text = (struct inst_t *)
+		((char *)image + sizeof(struct image_header_t));
+	code->size = header->size;
+	code->image = image;
+	code->image_size = st.st_size;
+	*priority = header->priority;
+	return code;
+}
+
+struct pcb_t * load(const char * path) {
+	/* Create new PCB for the new process */
+	struct pcb_t * proc = (struct pcb_t * )calloc(1, sizeof(struct pcb_t));
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	/* The address space is set up by the first allocation */
+	proc->seg_table = NULL;
+	proc->bp = 0;
+	proc->pc = 0;
+	proc->last_cpu = -1;
+
+	uint32_t bucket = hash_path(path);
+	pthread_mutex_lock(&cache_lock);
+	struct code_cache_t ** slot = &code_cache[bucket];
+	struct code_cache_t * entry = *slot;
+	while (entry != NULL && strcmp(entry->path, path)) {
+		entry = entry->next;
+	}
+	if (entry != NULL) {
+		entry->code->ref++;
+		proc->code = entry->code;
+		proc->priority = entry->priority;
+		pthread_mutex_unlock(&cache_lock);
+		return proc;
+	}
+
+	/* Read process code from file */
+	FILE * file;
+	if ((file = fopen(path, "r")) == NULL) {
+		printf("Cannot find process description at '%s'\n", path);
+		exit(1);		
+	}
+	struct image_header_t header;
+	if (fread(&header, sizeof(header), 1, file) == 1
+			&& header.magic == IMAGE_MAGIC) {
+		proc->code = map_image(file, path, &header, &proc->priority);
+	} else {
+		rewind(file);
+		proc->code = read_text(file, &proc->priority);
+	}
+	fclose(file);
+
+	proc->code->ref = 1;
+	proc->code->bucket = bucket;
+	entry = (struct code_cache_t *)malloc(sizeof(struct code_cache_t));
+	entry->path = strdup(path);
+	entry->code = proc->code;
+	entry->priority = proc->priority;
+	entry->next = *slot;
+	*slot = entry;
+	pthread_mutex_unlock(&cache_lock);
 	return proc;
 }
 
+struct pcb_t * clone_proc(const struct pcb_t * proc) {
+	struct pcb_t * child = (struct pcb_t*)calloc(1, sizeof(struct pcb_t));
+	child->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	child->priority = proc->priority;
+	memcpy(child->regs, proc->regs, sizeof(proc->regs));
+	child->pc = proc->pc;
+	child->last_cpu = -1;
+	pthread_mutex_lock(&cache_lock);
+	proc->code->ref++;
+	pthread_mutex_unlock(&cache_lock);
+	child->code = proc->code;
+	return child;
+}
 
+void release_code(struct code_seg_t * code) {
+	pthread_mutex_lock(&cache_lock);
+	if (--code->ref > 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	struct code_cache_t ** slot = &code_cache[code->bucket];
+	while (*slot != NULL && (*slot)->code != code) {
+		slot = &(*slot)->next;
+	}
+	if (*slot != NULL) {
+		struct code_cache_t * entry = *slot;
+		*slot = entry->next;
+		free(entry->path);
+		free(entry);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (code->image != NULL) {
+		munmap(code->image, code->image_size);
+	} else {
+		free(code->text);
+	}
+	free(code);
+}
+
+int compile_image(const char * src, const char * dst) {
+	FILE * in, * out;
+	if ((in = fopen(src, "r")) == NULL) {
+		printf("Cannot find process description at '%s'\n", src);
+		return 1;
+	}
+	struct image_header_t header;
+	header.magic = IMAGE_MAGIC;
+	header.version = IMAGE_VERSION;
+	struct code_seg_t * code = read_text(in, &header.priority);
+	header.size = code->size;
+	fclose(in);
+
+	int err = 0;
+	if ((out = fopen(dst, "wb")) == NULL) {
+		printf("Cannot create process image at '%s'\n", dst);
+		err = 1;
+	} else {
+		if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+				fwrite(code->text, sizeof(struct inst_t),
+					code->size, out) != code->size) {
+			printf("Cannot write process image at '%s'\n", dst);
+			err = 1;
+		}
+		if (fclose(out)) err = 1;
+	}
+	free(code->text);
+	free(code);
+	return err;
+}
 
@@ -1,11 +1,22 @@
 
+#include "instrument.h"
 #include "mem.h"
+#include "tlb.h"
 #include "stdlib.h"
 #include "string.h"
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
 
-static BYTE _ram[RAM_SIZE];
+/* Geometry in use, and what follows from it */
+static struct mem_geometry_t _geometry;
+static int _num_pages;		// Physical frames
+static int _offset_bits;	// Bits of the page offset
+static int _shift[MAX_LEVELS];	// Lowest bit of the index of each level
+static int _bits[MAX_LEVELS];	// Bits of the index of each level
+
+static BYTE * _ram;
 
 static struct {
 	uint32_t proc;	// ID of process currently uses this page
@@ -13,51 +24,619 @@ static struct {
 			// to the process.
 	int next;	// The next page in the list. -1 if it is the last
 			// page.
-} _mem_stat [NUM_PAGES];
+	struct seg_table_t * owner;	// Tables mapping the page, and
+	addr_t vpn;			// where, in swap mode
+	uint32_t ref;	// Rows mapping the frame, more than one once FORK
+			// shares it
+} * _mem_stat;
+
+/* Physical frames are split into NUM_ZONES zones of consecutive frames,
+ * each with its own lock. Bit [i] of _free_map is set if and only if
+ * frame [i] sits free in its zone.
+ *
+ * Free frames of a zone are also kept as a buddy system: runs of 2^k
+ * frames, aligned on 2^k from the start of the zone, linked in one list
+ * per order k. Single frames are still taken lowest index first from
+ * _free_map, splitting the run around them, and freed frames merge with
+ * their buddy as long as it is free too. */
+#define NUM_ZONES	4
+#define BUDDY_MAX_ORDER	20
+static uint64_t * _free_map;
+static int _zone_words;	// Words of _free_map per zone
+static int8_t * _order;	// Order of the free run starting at a frame, or -1
+static int * _run_prev;	// Neighbours of a free run in its list
+static int * _run_next;
+static int _huge_order;	// Frames of a huge page are 2^_huge_order, 0 if
+			// huge pages are off
+
+static struct zone_t {
+	pthread_mutex_t lock;
+	int first;	// First word of _free_map owned by the zone
+	int hint;	// No word of the zone before this one has a free frame
+	uint32_t num_free;
+	int begin;	// Frames of the zone
+	int end;
+	int runs[BUDDY_MAX_ORDER + 1];	// First free run of each order
+} _zone[NUM_ZONES];
+
+/* Number of frames not used by any process, wherever they are (zone
+ * or magazine). Allocations reserve their frames here before picking
+ * them so a failed allocation never has to undo anything */
+static int _num_free;
+
+/* Each CPU thread keeps a small cache (magazine) of free frames so that
+ * most allocations and frees only touch memory private to the CPU. A
+ * magazine is refilled from and drained to the zones MAG_BATCH frames
+ * at a time. Its lock is only contended when another CPU runs out of
+ * frames and steals from it. */
+#define MAG_SIZE	32
+#define MAG_BATCH	16
+
+struct magazine_t {
+	pthread_mutex_t lock;
+	int home;	// Zone the magazine refills from first
+	int count;
+	int frames[MAG_SIZE];
+	struct magazine_t * next;
+};
+
+static struct magazine_t * _mag_list = NULL;
+static pthread_mutex_t _mag_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct magazine_t * _mag = NULL;
+
+/* Swap mode. Every allocated page owns a slot of the swap file and only
+ * gets a frame while it is present. Page tables and frames are then
+ * protected by [lock], and accesses walk the page tables instead of
+ * going through the TLB so that accessed and dirty bits are exact */
+static struct {
+	int fd;		// Swap file, -1 if swap is off
+	int slots;
+	int num_free;	// Slots not reserved by any page
+	int hint;	// No slot before this one is free
+	uint8_t * used;
+	enum swap_policy_t policy;
+	pthread_mutex_t lock;
+	/* Frames holding pages, in the order the pages came in */
+	int * prev;
+	int * next;
+	int head;
+	int tail;
+	uint8_t * age;	// Aging counters of SWAP_LRU
+	uint64_t faults;
+	uint64_t zero_fills;	// Faults on pages which were never written out
+	uint64_t evictions;
+	uint64_t writebacks;
+} _swap = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Add the free run of 2^[order] frames at [frame] to its list */
+static void push_run(struct zone_t * zone, int frame, int order) {
+	_order[frame] = order;
+	_run_prev[frame] = -1;
+	_run_next[frame] = zone->runs[order];
+	if (zone->runs[order] >= 0) {
+		_run_prev[zone->runs[order]] = frame;
+	}
+	zone->runs[order] = frame;
+}
+
+static void remove_run(struct zone_t * zone, int frame) {
+	int order = _order[frame];
+	if (_run_prev[frame] >= 0) {
+		_run_next[_run_prev[frame]] = _run_next[frame];
+	}else{
+		zone->runs[order] = _run_next[frame];
+	}
+	if (_run_next[frame] >= 0) {
+		_run_prev[_run_next[frame]] = _run_prev[frame];
+	}
+	_order[frame] = -1;
+}
+
+/* Take free frame [frame] out of the run holding it, giving back the
+ * rest of the run as smaller runs. Caller must hold the zone lock */
+static void split_around(struct zone_t * zone, int frame) {
+	int k = 0;
+	int run = frame;
+	while (_order[run] != k) {
+		k++;
+		run = zone->begin + ((frame - zone->begin) & ~((1 << k) - 1));
+	}
+	remove_run(zone, run);
+	while (k > 0) {
+		k--;
+		if (frame < run + (1 << k)) {
+			push_run(zone, run + (1 << k), k);
+		}else{
+			push_run(zone, run, k);
+			run += 1 << k;
+		}
+	}
+}
+
+/* Give the run of 2^[order] frames at [frame] back to the buddy system,
+ * merging it with its buddies. Caller must hold the zone lock */
+static void merge_run(struct zone_t * zone, int frame, int order) {
+	while (order < BUDDY_MAX_ORDER) {
+		int buddy = zone->begin
+			+ ((frame - zone->begin) ^ (1 << order));
+		if (buddy >= zone->end || _order[buddy] != order) {
+			break;
+		}
+		remove_run(zone, buddy);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	push_run(zone, frame, order);
+}
+
+void init_mem(const struct mem_geometry_t * geometry) {
+	struct mem_geometry_t g = {DEFAULT_RAM_SIZE, DEFAULT_PAGE_SIZE,
+		DEFAULT_ADDRESS_BITS, DEFAULT_LEVELS};
+	if (geometry != NULL) {
+		g = *geometry;
+	}
+	_offset_bits = __builtin_ctz(g.page_size | (1U << 31));
+	int index_bits = g.address_bits - _offset_bits;
+	if ((g.page_size & (g.page_size - 1)) || g.page_size < 64
+			|| g.ram_size < g.page_size
+			|| g.ram_size / g.page_size > INT32_MAX
+			|| g.address_bits > 48 || g.levels < 2
+			|| g.levels > MAX_LEVELS || index_bits < g.levels) {
+		printf("Invalid memory geometry: %lu bytes of RAM, "
+			"%u-byte pages, %d-bit addresses, %d levels\n",
+			g.ram_size, g.page_size, g.address_bits, g.levels);
+		exit(1);
+	}
+	_geometry = g;
+	_num_pages = g.ram_size / g.page_size;
+
+	/* Levels share the index bits evenly, the first one takes the
+	 * rest */
+	int l;
+	int shift = _offset_bits;
+	for (l = g.levels - 1; l >= 0; l--) {
+		_bits[l] = l > 0 ? index_bits / g.levels
+			: index_bits - (g.levels - 1) * (index_bits / g.levels);
+		_shift[l] = shift;
+		shift += _bits[l];
+	}
+
+	_mem_stat = calloc(_num_pages, sizeof(*_mem_stat));
+	_ram = (BYTE*)calloc((size_t)_num_pages << _offset_bits, sizeof(BYTE));
+	int words = (_num_pages + 63) / 64;
+	_free_map = (uint64_t*)calloc(words, sizeof(uint64_t));
+	if (_mem_stat == NULL || _ram == NULL || _free_map == NULL) {
+		printf("Cannot allocate %lu bytes of RAM\n", g.ram_size);
+		exit(1);
+	}
+	_order = (int8_t*)malloc(_num_pages * sizeof(int8_t));
+	_run_prev = (int*)malloc(_num_pages * sizeof(int));
+	_run_next = (int*)malloc(_num_pages * sizeof(int));
+	if (_order == NULL || _run_prev == NULL || _run_next == NULL) {
+		printf("Cannot allocate %lu bytes of RAM\n", g.ram_size);
+		exit(1);
+	}
+	memset(_order, -1, _num_pages * sizeof(int8_t));
+	int i;
+	for (i = 0; i < _num_pages; i++) {
+		_free_map[i >> 6] |= 1ULL << (i & 63);
+	}
+	_zone_words = (words + NUM_ZONES - 1) / NUM_ZONES;
+	int smallest = _num_pages;
+	for (i = 0; i < NUM_ZONES; i++) {
+		struct zone_t * zone = &_zone[i];
+		pthread_mutex_init(&zone->lock, NULL);
+		zone->first = i * _zone_words;
+		zone->hint = zone->first;
+		zone->begin = zone->first * 64;
+		zone->end = (i + 1) * _zone_words * 64;
+		if (zone->end > _num_pages) {
+			zone->end = _num_pages;
+		}
+		if (zone->begin > zone->end) {
+			zone->begin = zone->end;
+		}
+		zone->num_free = zone->end - zone->begin;
+		memset(zone->runs, -1, sizeof(zone->runs));
+		/* Cut the zone into the largest aligned runs */
+		int frame = zone->begin;
+		while (frame < zone->end) {
+			int k = 0;
+			while (k < BUDDY_MAX_ORDER
+				&& ((frame - zone->begin) & (1 << k)) == 0
+				&& frame + (2 << k) <= zone->end) {
+				k++;
+			}
+			push_run(zone, frame, k);
+			frame += 1 << k;
+		}
+		if (zone->end > zone->begin
+				&& zone->end - zone->begin < smallest) {
+			smallest = zone->end - zone->begin;
+		}
+	}
+	_num_free = _num_pages;
+
+	/* A huge page takes the place of a whole last level table */
+	_huge_order = _bits[g.levels - 1];
+	if (_huge_order > BUDDY_MAX_ORDER || (1 << _huge_order) > smallest) {
+		_huge_order = 0;
+	}
+}
+
+const struct mem_geometry_t * mem_geometry(void) {
+	return &_geometry;
+}
+
+void attach_mem(int cpu) {
+	struct magazine_t * mag =
+		(struct magazine_t*)calloc(1, sizeof(struct magazine_t));
+	pthread_mutex_init(&mag->lock, NULL);
+	mag->home = cpu % NUM_ZONES;
+	pthread_mutex_lock(&_mag_list_lock);
+	mag->next = _mag_list;
+	__atomic_store_n(&_mag_list, mag, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_mag_list_lock);
+	_mag = mag;
+	tlb_attach(cpu);
+}
+
+/* Move up to [n] free frames of zone [z], lowest index first, to
+ * [frames]. Return the number of frames taken */
+static uint32_t take_from_zone(int z, int * frames, uint32_t n) {
+	struct zone_t * zone = &_zone[z];
+	uint32_t got = 0;
+	LOCK(&zone->lock, LOCK_ZONE);
+	while (got < n && zone->num_free > 0) {
+		while (_free_map[zone->hint] == 0) {
+			zone->hint++;
+			COUNT(CNT_FREE_MAP_WORDS, 1);
+		}
+		COUNT(CNT_FREE_MAP_WORDS, 1);
+		uint64_t word = _free_map[zone->hint];
+		_free_map[zone->hint] = word & (word - 1);
+		zone->num_free--;
+		frames[got] = (zone->hint << 6) + __builtin_ctzll(word);
+		split_around(zone, frames[got++]);
+	}
+	UNLOCK(&zone->lock, LOCK_ZONE);
+	return got;
+}
+
+/* Move up to [n] free frames to [frames], visiting zones in order from
+ * zone [home]. Return the number of frames taken */
+static uint32_t take_from_zones(int home, int * frames, uint32_t n) {
+	uint32_t got = 0;
+	int i;
+	for (i = 0; i < NUM_ZONES && got < n; i++) {
+		got += take_from_zone((home + i) % NUM_ZONES,
+			frames + got, n - got);
+	}
+	return got;
+}
+
+/* Give [n] frames back to their zones */
+static void put_to_zones(int * frames, uint32_t n) {
+	uint32_t i;
+	struct zone_t * zone = NULL;
+	for (i = 0; i < n; i++) {
+		int word = frames[i] >> 6;
+		struct zone_t * owner = &_zone[word / _zone_words];
+		if (owner != zone) {
+			if (zone != NULL) {
+				UNLOCK(&zone->lock, LOCK_ZONE);
+			}
+			zone = owner;
+			LOCK(&zone->lock, LOCK_ZONE);
+		}
+		_free_map[word] |= 1ULL << (frames[i] & 63);
+		zone->num_free++;
+		if (word < zone->hint) {
+			zone->hint = word;
+		}
+		merge_run(zone, frames[i], 0);
+	}
+	if (zone != NULL) {
+		UNLOCK(&zone->lock, LOCK_ZONE);
+	}
+}
+
+/* Take a run of 2^[order] contiguous frames, visiting zones in order
+ * from zone [home]. Return its first frame, or -1 if no zone has one.
+ * The caller must have reserved the frames in _num_free */
+static int take_run(int home, int order) {
+	int i;
+	for (i = 0; i < NUM_ZONES; i++) {
+		struct zone_t * zone = &_zone[(home + i) % NUM_ZONES];
+		LOCK(&zone->lock, LOCK_ZONE);
+		int k = order;
+		while (k <= BUDDY_MAX_ORDER && zone->runs[k] < 0) {
+			k++;
+		}
+		if (k > BUDDY_MAX_ORDER) {
+			UNLOCK(&zone->lock, LOCK_ZONE);
+			continue;
+		}
+		int run = zone->runs[k];
+		remove_run(zone, run);
+		while (k > order) {
+			k--;
+			push_run(zone, run + (1 << k), k);
+		}
+		int frame;
+		for (frame = run; frame < run + (1 << order); frame++) {
+			_free_map[frame >> 6] &= ~(1ULL << (frame & 63));
+		}
+		zone->num_free -= 1 << order;
+		UNLOCK(&zone->lock, LOCK_ZONE);
+		return run;
+	}
+	return -1;
+}
+
+/* Give the run of 2^[order] frames at [run] taken by take_run() back */
+static void put_run(int run, int order) {
+	struct zone_t * zone = &_zone[(run >> 6) / _zone_words];
+	LOCK(&zone->lock, LOCK_ZONE);
+	int frame;
+	for (frame = run; frame < run + (1 << order); frame++) {
+		_free_map[frame >> 6] |= 1ULL << (frame & 63);
+	}
+	zone->num_free += 1 << order;
+	if ((run >> 6) < zone->hint) {
+		zone->hint = run >> 6;
+	}
+	merge_run(zone, run, order);
+	UNLOCK(&zone->lock, LOCK_ZONE);
+	__atomic_add_fetch(&_num_free, 1 << order, __ATOMIC_RELEASE);
+}
+
+/* Take up to [n] frames cached in magazines of other CPUs */
+static uint32_t steal_from_magazines(int * frames, uint32_t n) {
+	uint32_t got = 0;
+	struct magazine_t * mag =
+		__atomic_load_n(&_mag_list, __ATOMIC_ACQUIRE);
+	for (; mag != NULL && got < n; mag = mag->next) {
+		if (mag == _mag) {
+			continue;
+		}
+		LOCK(&mag->lock, LOCK_MAGAZINE);
+		while (got < n && mag->count > 0) {
+			frames[got++] = mag->frames[--mag->count];
+		}
+		UNLOCK(&mag->lock, LOCK_MAGAZINE);
+	}
+	return got;
+}
 
-static pthread_mutex_t mem_lock;
+/* Collect [n] free frames into [frames]. The caller must have reserved
+ * them in _num_free first, so they exist in a zone or a magazine */
+static void get_frames(int * frames, uint32_t n) {
+	struct magazine_t * mag = _mag;
+	uint32_t got = 0;
+	if (mag != NULL) {
+		LOCK(&mag->lock, LOCK_MAGAZINE);
+		if (mag->count < n) {
+			uint32_t want = n - mag->count;
+			if (want < MAG_BATCH) {
+				want = MAG_BATCH;
+			}
+			if (want > MAG_SIZE - mag->count) {
+				want = MAG_SIZE - mag->count;
+			}
+			int * fill = mag->frames + mag->count;
+			uint32_t taken = take_from_zones(mag->home, fill, want);
+			/* Frames are popped from the top, reverse them so
+			 * that they are handed out lowest index first */
+			uint32_t j;
+			for (j = 0; j < taken / 2; j++) {
+				int tmp = fill[j];
+				fill[j] = fill[taken - 1 - j];
+				fill[taken - 1 - j] = tmp;
+			}
+			mag->count += taken;
+		}
+		while (got < n && mag->count > 0) {
+			frames[got++] = mag->frames[--mag->count];
+		}
+		UNLOCK(&mag->lock, LOCK_MAGAZINE);
+	}
+	/* Large requests, or frames cached by other CPUs. Frames may be
+	 * in transit between a zone and a magazine, so keep trying until
+	 * the reserved amount shows up */
+	while (got < n) {
+		got += take_from_zones(mag ? mag->home : 0,
+			frames + got, n - got);
+		if (got < n) {
+			got += steal_from_magazines(frames + got, n - got);
+		}
+	}
+}
 
-void init_mem(void) {
-	memset(_mem_stat, 0, sizeof(*_mem_stat) * NUM_PAGES);
-	memset(_ram, 0, sizeof(BYTE) * RAM_SIZE);
-	pthread_mutex_init(&mem_lock, NULL);
+/* Release frame [index], which must not be used by any process anymore */
+static void put_frame(int index) {
+	struct magazine_t * mag = _mag;
+	if (mag == NULL) {
+		put_to_zones(&index, 1);
+	}else{
+		LOCK(&mag->lock, LOCK_MAGAZINE);
+		if (mag->count == MAG_SIZE) {
+			mag->count -= MAG_BATCH;
+			put_to_zones(mag->frames + mag->count, MAG_BATCH);
+		}
+		mag->frames[mag->count++] = index;
+		UNLOCK(&mag->lock, LOCK_MAGAZINE);
+	}
+	__atomic_add_fetch(&_num_free, 1, __ATOMIC_RELEASE);
 }
 
 /* get offset of the virtual address */
 static addr_t get_offset(addr_t addr) {
-	return addr & ~((~0U) << OFFSET_LEN);
+	return addr & (_geometry.page_size - 1);
 }
 
-/* get the first layer index */
-static addr_t get_first_lv(addr_t addr) {
-	return addr >> (OFFSET_LEN + PAGE_LEN);
+/* get the index of [addr] in a table of level [level], 0 being the
+ * first layer */
+static addr_t get_index(addr_t addr, int level) {
+	return (addr >> _shift[level]) & ((1ULL << _bits[level]) - 1);
 }
 
-/* get the second layer index */
-static addr_t get_second_lv(addr_t addr) {
-	return (addr >> OFFSET_LEN) - (get_first_lv(addr) << PAGE_LEN);
+/* Row of page table [pages] mapping [virtual_addr] */
+static struct pte_t * leaf_row(struct page_table_t * pages,
+		addr_t virtual_addr) {
+	if (pages->table[0].huge) {
+		return &pages->table[0];
+	}
+	return &pages->table[get_index(virtual_addr, _geometry.levels - 1)];
 }
 
-/* Search for page table table from the a segment table */
-static struct page_table_t * get_page_table(
-		addr_t index, 	// Segment level index
-		struct seg_table_t * seg_table) { // first level table
-	
-	/*
-	 * TODO: Given the Segment index [index], you must go through each
-	 * row of the segment table [seg_table] and check if the v_index
-	 * field of the row is equal to the index
-	 *
-	 * */
+/* Bytes mapped by a huge page */
+static addr_t huge_size(void) {
+	return 1ULL << _shift[_geometry.levels - 2];
+}
 
-	int i;
-	for (i = 0; i < seg_table->size; i++) {
-		// Enter your code here
-		if(seg_table->table[i].v_index == index) {
-			return seg_table->table[i].pages;
+/* Allocate an empty table of level [level] */
+static void * new_table(int level) {
+	if (level == _geometry.levels - 1) {
+		return calloc(1, sizeof(struct page_table_t)
+			+ (sizeof(struct pte_t) << _bits[level]));
+	}
+	return calloc(1, sizeof(struct seg_table_t)
+		+ (sizeof(void*) << _bits[level]));
+}
+
+/* Get the row of [seg_table] mapping [virtual_addr]. Return NULL if
+ * the page of [virtual_addr] is not allocated */
+static struct pte_t * get_row(
+		addr_t virtual_addr,
+		struct seg_table_t * seg_table) {
+	COUNT(CNT_TRANSLATIONS, 1);
+	if (seg_table == NULL || virtual_addr >> _geometry.address_bits) {
+		return NULL;
+	}
+	/* Walk down the segment tables to the page table */
+	void * table = seg_table;
+	int level;
+	for (level = 0; level < _geometry.levels - 1; level++) {
+		COUNT(CNT_TRANSLATE_PROBES, 1);
+		table = ((struct seg_table_t*)table)->table[
+			get_index(virtual_addr, level)];
+		if (table == NULL) {
+			return NULL;
+		}
+	}
+	COUNT(CNT_TRANSLATE_PROBES, 1);
+	struct pte_t * row = leaf_row((struct page_table_t*)table,
+		virtual_addr);
+	return row->valid ? row : NULL;
+}
+
+/* Map the page of [virtual_addr] in the tables of [proc], creating
+ * missing tables on the way. With [huge] set, map the whole range of
+ * the last level table instead, which must not exist yet. Return the
+ * row, cleared but valid */
+static struct pte_t * map_page(addr_t virtual_addr, struct pcb_t * proc,
+		int huge) {
+	void * table = proc->seg_table;
+	int level;
+	for (level = 0; level < _geometry.levels - 1; level++) {
+		struct seg_table_t * seg = (struct seg_table_t*)table;
+		void ** next = &seg->table[get_index(virtual_addr, level)];
+		if (*next == NULL) {
+			if (huge && level == _geometry.levels - 2) {
+				*next = calloc(1, sizeof(struct page_table_t)
+					+ sizeof(struct pte_t));
+			}else{
+				*next = new_table(level + 1);
+			}
+			seg->size++;
 		}
+		table = *next;
+	}
+	struct page_table_t * pages = (struct page_table_t*)table;
+	struct pte_t * row = huge ? &pages->table[0]
+		: &pages->table[get_index(virtual_addr, level)];
+	memset(row, 0, sizeof(*row));
+	row->valid = 1;
+	row->huge = huge;
+	pages->size++;
+	return row;
+}
+
+/* Give [proc] an address space on its first allocation. Page 0 is never
+ * mapped so that address 0 can tell that an allocation failed */
+static void init_space(struct pcb_t * proc) {
+	if (proc->seg_table == NULL) {
+		proc->seg_table = (struct seg_table_t*)new_table(0);
+	}
+	if (proc->bp == 0) {
+		proc->bp = _geometry.page_size;
+	}
+}
+
+/* Find [num_pages] pages of unused virtual space in [proc], first fit
+ * among the ranges freed below the break pointer, else at the break
+ * pointer. Return 0 if the address space is full */
+static addr_t take_range(struct pcb_t * proc, uint32_t num_pages) {
+	addr_t size = (addr_t)num_pages * _geometry.page_size;
+	struct vm_range_t ** link;
+	for (link = &proc->free_ranges; *link != NULL; link = &(*link)->next) {
+		struct vm_range_t * range = *link;
+		if (range->size >= size) {
+			addr_t start = range->start;
+			range->start += size;
+			range->size -= size;
+			if (range->size == 0) {
+				*link = range->next;
+				free(range);
+			}
+			return start;
+		}
+	}
+	if (size + proc->bp > 1ULL << _geometry.address_bits) {
+		return 0;
+	}
+	addr_t start = proc->bp;
+	proc->bp += size;
+	return start;
+}
+
+/* Give [size] bytes of virtual space at [start] back to [proc], merging
+ * it with the free ranges next to it. Space freed up to the break pointer
+ * lowers the break pointer instead */
+static void put_range(struct pcb_t * proc, addr_t start, addr_t size) {
+	struct vm_range_t ** link = &proc->free_ranges;
+	struct vm_range_t ** prev_link = NULL;
+	while (*link != NULL && (*link)->start < start) {
+		prev_link = link;
+		link = &(*link)->next;
+	}
+	struct vm_range_t * next = *link;
+	struct vm_range_t * range;
+	if (prev_link != NULL
+			&& (*prev_link)->start + (*prev_link)->size == start) {
+		range = *prev_link;
+		range->size += size;
+	}else{
+		range = (struct vm_range_t*)malloc(sizeof(struct vm_range_t));
+		range->start = start;
+		range->size = size;
+		range->next = next;
+		*link = range;
+		prev_link = link;
+	}
+	if (next != NULL && range->start + range->size == next->start) {
+		range->size += next->size;
+		range->next = next->next;
+		free(next);
+	}
+	if (range->next == NULL && range->start + range->size == proc->bp) {
+		proc->bp = range->start;
+		*prev_link = NULL;
+		free(range);
 	}
-	return NULL;
 }
 
 /* Translate virtual address to physical address. If [virtual_addr] is valid,
@@ -68,122 +647,493 @@ static int translate(
 		addr_t * physical_addr, // Physical address to be returned
 		struct pcb_t * proc) {  // Process uses given virtual address
 
-	/* Offset of the virtual address */
-	addr_t offset = get_offset(virtual_addr);
-	/* The first layer index */
-	addr_t first_lv = get_first_lv(virtual_addr);
-	/* The second layer index */
-	addr_t second_lv = get_second_lv(virtual_addr);
+	struct pte_t * row = get_row(virtual_addr, proc->seg_table);
+	if (row == NULL || !row->present) {
+		return 0;
+	}
+	if (physical_addr) {
+		*physical_addr = (row->p_index << _offset_bits)
+			+ (row->huge ? virtual_addr & (huge_size() - 1)
+				: get_offset(virtual_addr));
+	}
+	return 1;
+}
+
+/* Clear the row mapping [virtual_addr] and free the tables which no
+ * longer map anything, except the first layer one */
+static void unmap_page(addr_t virtual_addr, struct seg_table_t * seg_table) {
+	struct seg_table_t * path[MAX_LEVELS];
+	void * table = seg_table;
+	int level;
+	for (level = 0; level < _geometry.levels - 1; level++) {
+		path[level] = (struct seg_table_t*)table;
+		table = path[level]->table[get_index(virtual_addr, level)];
+	}
+	struct page_table_t * pages = (struct page_table_t*)table;
+	struct pte_t * row = leaf_row(pages, virtual_addr);
+	row->valid = 0;
+	row->present = 0;
 	
-	/* Search in the first level */
-	struct page_table_t * page_table = get_page_table(
-		first_lv, 
-		proc->seg_table
-	);
-	if (page_table == NULL) {
+	int empty = (--pages->size == 0);
+	for (level--; level >= 0 && empty; level--) {
+		free(table);
+		path[level]->table[get_index(virtual_addr, level)] = NULL;
+		table = path[level];
+		empty = (--path[level]->size == 0) && level > 0;
+	}
+}
+
+/* Add frame [frame] at the tail of the frames holding pages */
+static void resident_append(int frame) {
+	_swap.prev[frame] = _swap.tail;
+	_swap.next[frame] = -1;
+	if (_swap.tail >= 0) {
+		_swap.next[_swap.tail] = frame;
+	}else{
+		_swap.head = frame;
+	}
+	_swap.tail = frame;
+}
+
+static void resident_remove(int frame) {
+	if (_swap.prev[frame] >= 0) {
+		_swap.next[_swap.prev[frame]] = _swap.next[frame];
+	}else{
+		_swap.head = _swap.next[frame];
+	}
+	if (_swap.next[frame] >= 0) {
+		_swap.prev[_swap.next[frame]] = _swap.prev[frame];
+	}else{
+		_swap.tail = _swap.prev[frame];
+	}
+}
+
+/* Row of the page held by frame [frame] */
+static struct pte_t * frame_row(int frame) {
+	return get_row(_mem_stat[frame].vpn << _offset_bits,
+		_mem_stat[frame].owner);
+}
+
+/* Write a page out to make room for another one. Return the frame it
+ * used. Caller must hold the swap lock */
+static int evict(void) {
+	int frame = _swap.head;
+	struct pte_t * row;
+	if (_swap.policy == SWAP_CLOCK) {
+		/* Pages used since the hand last passed go around again */
+		while ((row = frame_row(frame))->accessed) {
+			row->accessed = 0;
+			resident_remove(frame);
+			resident_append(frame);
+			frame = _swap.head;
+		}
+	}else if (_swap.policy == SWAP_LRU) {
+		/* Age every page and pick the oldest, the one brought
+		 * in first on ties */
+		int f, oldest = 256;
+		for (f = _swap.head; f >= 0; f = _swap.next[f]) {
+			row = frame_row(f);
+			_swap.age[f] = (_swap.age[f] >> 1)
+				| (row->accessed << 7);
+			row->accessed = 0;
+			if (_swap.age[f] < oldest) {
+				oldest = _swap.age[f];
+				frame = f;
+			}
+		}
+	}
+	row = frame_row(frame);
+	if (row->dirty) {
+		size_t size = _geometry.page_size;
+		if (pwrite(_swap.fd, _ram + ((size_t)frame << _offset_bits),
+				size, (off_t)row->slot * size) != size) {
+			printf("Cannot write to swap file\n");
+			exit(1);
+		}
+		row->swapped = 1;
+		_swap.writebacks++;
+	}
+	row->present = 0;
+	row->dirty = 0;
+	resident_remove(frame);
+	_mem_stat[frame].proc = 0;
+	_mem_stat[frame].owner = NULL;
+	_swap.evictions++;
+	return frame;
+}
+
+/* Bring the page [vpn] of process [pid] mapped by [row] of [owner] into
+ * a frame. Caller must hold the swap lock */
+static void page_in(struct seg_table_t * owner, uint32_t pid, addr_t vpn,
+		struct pte_t * row) {
+	int frame;
+	if (__atomic_sub_fetch(&_num_free, 1, __ATOMIC_ACQUIRE) >= 0) {
+		get_frames(&frame, 1);
+	}else{
+		__atomic_add_fetch(&_num_free, 1, __ATOMIC_RELEASE);
+		frame = evict();
+	}
+	size_t size = _geometry.page_size;
+	BYTE * page = _ram + ((size_t)frame << _offset_bits);
+	if (row->swapped) {
+		if (pread(_swap.fd, page, size, (off_t)row->slot * size)
+				!= size) {
+			printf("Cannot read from swap file\n");
+			exit(1);
+		}
+	}else{
+		/* Never written out, so still all zero */
+		memset(page, 0, size);
+		_swap.zero_fills++;
+	}
+	row->p_index = frame;
+	row->present = 1;
+	row->dirty = 0;
+	row->accessed = 0;
+	_mem_stat[frame].proc = pid;
+	_mem_stat[frame].index = -1;
+	_mem_stat[frame].next = -1;
+	_mem_stat[frame].owner = owner;
+	_mem_stat[frame].vpn = vpn;
+	_mem_stat[frame].ref = 1;
+	_swap.age[frame] = 0;
+	resident_append(frame);
+	_swap.faults++;
+}
+
+/* Swap mode counterpart of alloc_mem(): map [num_pages] pages to swap
+ * slots, they get frames on first use */
+static addr_t swap_alloc(uint32_t num_pages, struct pcb_t * proc) {
+	addr_t ret_mem = take_range(proc, num_pages);
+	if (ret_mem == 0) {
 		return 0;
 	}
+	pthread_mutex_lock(&_swap.lock);
+	if (_swap.num_free < num_pages) {
+		pthread_mutex_unlock(&_swap.lock);
+		put_range(proc, ret_mem, (addr_t)num_pages
+			* _geometry.page_size);
+		return 0;
+	}
+	_swap.num_free -= num_pages;
+	uint32_t i;
+	for (i = 0; i < num_pages; i++) {
+		while (_swap.used[_swap.hint]) {
+			_swap.hint++;
+		}
+		_swap.used[_swap.hint] = 1;
 
-	int i;
-	for (i = 0; i < page_table->size; i++) {
-		if (page_table->table[i].v_index == second_lv) {
-			/* TODO: Concatenate the offset of the virtual addess
-			 * to [p_index] field of page_table->table[i] to 
-			 * produce the correct physical address and save it to
-			 * [*physical_addr]  */
-			if(physical_addr) 
-				*physical_addr = (page_table->table[i].p_index << OFFSET_LEN) + offset;
-			return 1;
+		struct pte_t * row = map_page(
+			ret_mem + (addr_t)i * _geometry.page_size, proc, 0);
+		row->slot = _swap.hint;
+		row->first = (i == 0);
+		row->last = (i == num_pages - 1);
+	}
+	pthread_mutex_unlock(&_swap.lock);
+	return ret_mem;
+}
+
+/* Whether [address] is the start of a region of [proc]. Registers keep
+ * addresses of freed regions, and their range may since be reused by a
+ * region starting elsewhere */
+static int region_start(addr_t address, struct pcb_t * proc) {
+	struct pte_t * row = get_row(address, proc->seg_table);
+	return row != NULL && row->first
+		&& (!row->huge || (address & (huge_size() - 1)) == 0);
+}
+
+/* Swap mode counterpart of free_mem() */
+static int swap_free(addr_t address, struct pcb_t * proc) {
+	address -= get_offset(address);
+	pthread_mutex_lock(&_swap.lock);
+	if (!region_start(address, proc)) {
+		pthread_mutex_unlock(&_swap.lock);
+		return 1;
+	}
+	addr_t virtual_addr = address;
+	int last = 0;
+	while (!last) {
+		struct pte_t * row = get_row(virtual_addr, proc->seg_table);
+		if (row == NULL) {
+			break;
+		}
+		last = row->last;
+		if (row->present) {
+			int frame = row->p_index;
+			resident_remove(frame);
+			_mem_stat[frame].proc = 0;
+			_mem_stat[frame].owner = NULL;
+			put_frame(frame);
 		}
+		_swap.used[row->slot] = 0;
+		_swap.num_free++;
+		if (row->slot < _swap.hint) {
+			_swap.hint = row->slot;
+		}
+		unmap_page(virtual_addr, proc->seg_table);
+		virtual_addr += _geometry.page_size;
 	}
-	return 0;	
+	pthread_mutex_unlock(&_swap.lock);
+	put_range(proc, address, virtual_addr - address);
+	return 0;
 }
 
-addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
-	pthread_mutex_lock(&mem_lock);
+/* Swap mode counterpart of read_mem() and write_mem(): read the byte at
+ * [address] to [data], or write [data] there if [write] is set. Page
+ * the byte in first if it is swapped out */
+static int swap_access(addr_t address, struct pcb_t * proc, BYTE * data,
+		int write) {
+	pthread_mutex_lock(&_swap.lock);
+	struct pte_t * row = get_row(address, proc->seg_table);
+	if (row == NULL) {
+		pthread_mutex_unlock(&_swap.lock);
+		return 1;
+	}
+	if (!row->present) {
+		page_in(proc->seg_table, proc->pid, address >> _offset_bits,
+			row);
+	}
+	row->accessed = 1;
+	addr_t physical_addr = (row->p_index << _offset_bits)
+		+ get_offset(address);
+	if (write) {
+		row->dirty = 1;
+		_ram[physical_addr] = *data;
+	}else{
+		*data = _ram[physical_addr];
+	}
+	pthread_mutex_unlock(&_swap.lock);
+	return 0;
+}
+
+/* Frames of a region are chained in page order through _mem_stat[].next
+ * (see alloc_mem()). After FORK a shared frame stays in the chain of the
+ * process it is recorded under only, so a chain never leaves a process.
+ * Rebuild the chain of [proc] over the region holding [virtual_addr],
+ * which only its own CPU changes */
+static void relink_region(addr_t virtual_addr, struct pcb_t * proc) {
+	virtual_addr -= get_offset(virtual_addr);
+	while (!region_start(virtual_addr, proc)) {
+		virtual_addr -= _geometry.page_size;
+	}
+	int prev = -1, index = 0, last = 0;
+	while (!last) {
+		struct pte_t * row = get_row(virtual_addr, proc->seg_table);
+		uint32_t j, n = row->huge ? 1U << _huge_order : 1;
+		for (j = 0; j < n; j++, index++) {
+			int frame = row->p_index + j;
+			if (_mem_stat[frame].proc != proc->pid) {
+				continue;
+			}
+			_mem_stat[frame].index = index;
+			if (prev >= 0) {
+				_mem_stat[prev].next = frame;
+			}
+			prev = frame;
+		}
+		last = row->last;
+		virtual_addr += (addr_t)n * _geometry.page_size;
+	}
+	if (prev >= 0) {
+		_mem_stat[prev].next = -1;
+	}
+}
+
+/* Drop the reference of a row of process [pid] to [frame]. Return 1 if
+ * it was the last one, the frame must then be given back */
+static int drop_frame(int frame, uint32_t pid) {
+	if (__atomic_load_n(&_mem_stat[frame].ref, __ATOMIC_ACQUIRE) > 1) {
+		/* Out of the chain of [pid] before another sharer may
+		 * take the frame over */
+		if (_mem_stat[frame].proc == pid) {
+			_mem_stat[frame].next = -1;
+		}
+		if (__atomic_sub_fetch(&_mem_stat[frame].ref, 1,
+				__ATOMIC_ACQ_REL) > 0) {
+			return 0;
+		}
+	}
+	_mem_stat[frame].proc = 0;
+	_mem_stat[frame].index = -1;
+	_mem_stat[frame].next = -1;
+	_mem_stat[frame].ref = 0;
+	return 1;
+}
+
+/* Give [proc] a private copy of the shared page of [virtual_addr] mapped
+ * by [row] before it is written. Return 0 if no frame is left for it */
+static int copy_on_write(addr_t virtual_addr, struct pte_t * row,
+		struct pcb_t * proc) {
+	int frame = row->p_index;
+	if (__atomic_load_n(&_mem_stat[frame].ref, __ATOMIC_ACQUIRE) == 1) {
+		/* Every other process has let go of it already */
+		row->cow = 0;
+		if (_mem_stat[frame].proc != proc->pid) {
+			_mem_stat[frame].proc = proc->pid;
+			relink_region(virtual_addr, proc);
+		}
+		return 1;
+	}
+	if (__atomic_sub_fetch(&_num_free, 1, __ATOMIC_ACQUIRE) < 0) {
+		__atomic_add_fetch(&_num_free, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+	int copy;
+	get_frames(&copy, 1);
+	COUNT(CNT_COW_COPIES, 1);
+	memcpy(_ram + ((size_t)copy << _offset_bits),
+		_ram + ((size_t)frame << _offset_bits), _geometry.page_size);
+	_mem_stat[copy].proc = proc->pid;
+	_mem_stat[copy].next = -1;
+	_mem_stat[copy].ref = 1;
+	row->p_index = copy;
+	row->cow = 0;
+	/* Other CPUs may still hold the old frame for this page */
+	tlb_invalidate(proc->pid, virtual_addr >> _offset_bits);
+	if (drop_frame(frame, proc->pid)) {
+		put_frame(frame);
+	}
+	relink_region(virtual_addr, proc);
+	return 1;
+}
+
+/* Translate [virtual_addr] with the TLB of the calling CPU and only walk
+ * the page tables of [proc] on a miss. Same contract as translate().
+ * Shared pages are cached read-only, and copied first if [write] is
+ * set */
+static int lookup(
+		addr_t virtual_addr,
+		addr_t * physical_addr,
+		struct pcb_t * proc,
+		int write) {
+	addr_t vpn = virtual_addr >> _offset_bits;
+	addr_t frame;
+	if (tlb_lookup(proc->pid, vpn, &frame, write)) {
+		*physical_addr = (frame << _offset_bits)
+			+ get_offset(virtual_addr);
+		return 1;
+	}
+	struct pte_t * row = get_row(virtual_addr, proc->seg_table);
+	if (row == NULL || !row->present) {
+		return 0;
+	}
+	if (write && row->cow && !copy_on_write(virtual_addr, row, proc)) {
+		return 0;
+	}
+	translate(virtual_addr, physical_addr, proc);
+	tlb_insert(proc->pid, vpn, *physical_addr >> _offset_bits, !row->cow);
+	return 1;
+}
 
+addr_t alloc_mem(uint32_t size, struct pcb_t * proc) {
 	addr_t ret_mem = 0;
 	/* TODO: Allocate [size] byte in the memory for the
 	 * process [proc] and save the address of the first
 	 * byte in the allocated memory region to [ret_mem].
 	 * */
 
-	uint32_t num_pages = (size % PAGE_SIZE) ? (size / PAGE_SIZE + 1) :
-		size / PAGE_SIZE; // Number of pages we will use
+	uint32_t page_size = _geometry.page_size;
+	uint32_t num_pages = (size % page_size) ? (size / page_size + 1) :
+		size / page_size; // Number of pages we will use
 	int mem_avail = 0; // We could allocate new memory region or not?
+	COUNT(CNT_ALLOCS, 1);
+	init_space(proc);
+	if (_swap.fd >= 0) {
+		return swap_alloc(num_pages, proc);
+	}
 
 	/* First we must check if the amount of free memory in
 	 * virtual address space and physical address space is
 	 * large enough to represent the amount of required 
 	 * memory. If so, set 1 to [mem_avail].
-	 * Hint: check [proc] bit in each page of _mem_stat
-	 * to know whether this page has been used by a process.
-	 * For virtual memory space, check bp (break pointer).
+	 * Hint: frames are reserved by taking them off _num_free,
+	 * which counts frames not used by any process.
+	 * For virtual memory space, take_range() finds a free range.
 	 * */
 	
-	uint32_t num_free_pages = 0; // Count for number of free pages
-	for(int i = 0; i < NUM_PAGES; ++i) {
-		if(_mem_stat[i].proc == 0) num_free_pages++;
-	}
-	if(num_free_pages >= num_pages) {
-		if(num_pages * PAGE_SIZE + proc->bp <= RAM_SIZE)
+	ret_mem = take_range(proc, num_pages);
+	if(ret_mem != 0) {
+		if(__atomic_sub_fetch(&_num_free, num_pages,
+				__ATOMIC_ACQUIRE) >= 0) {
 			mem_avail = 1;
+		}else{
+			__atomic_add_fetch(&_num_free, num_pages,
+				__ATOMIC_RELEASE);
+			put_range(proc, ret_mem, (addr_t)num_pages * page_size);
+			ret_mem = 0;
+		}
 	}
 	if (mem_avail) {
 		/* We could allocate new memory region to the process */
-		ret_mem = proc->bp;
-		proc->bp += num_pages * PAGE_SIZE;
 		/* Update status of physical pages which will be allocated
 		 * to [proc] in _mem_stat. Tasks to do:
 		 * 	- Update [proc], [index], and [next] field
 		 * 	- Add entries to segment table page tables of [proc]
 		 * 	  to ensure accesses to allocated memory slot is
 		 * 	  valid. */
-		// if(ret_mem == PAGE_SIZE) {
-		// 	proc->seg_table->size = 0;
-		// 	for(int i = 0; i < (1 << SEGMENT_LEN); i++) {
-		// 		proc->seg_table->table[i].pages = NULL;
-		// 	}
-		// }
+		/* Frames are private to this thread once taken, and page
+		 * tables of [proc] are only touched by the CPU running it,
+		 * so the rest needs no lock */
+		int * frames = (int*)malloc(sizeof(int) * num_pages);
 		int i = 0; // Index of the page which will be allocated
-		int idx = 0; // Iterator for _mem_stats
 		int prev = 0; // Index of previous frame
-		while(i < num_pages && idx < NUM_PAGES) {
-			if(_mem_stat[idx].proc == 0) {
-				/* Update _mem_stat */
-				_mem_stat[idx].proc = proc->pid;
-				_mem_stat[idx].index = i;
-				_mem_stat[idx].next = -1;
-				if(i > 0) _mem_stat[prev].next = idx;
-				
+		uint32_t small = num_pages;
+		/* Ranges of the region covering a whole last level table
+		 * get a huge page when a run of frames is free for it */
+		uint32_t huge_pages = 1U << _huge_order;
+		while(_huge_order > 0 && i < num_pages) {
+			addr_t virtual_addr = ret_mem + (addr_t)i * page_size;
+			frames[i] = -1;
+			if ((virtual_addr & (huge_size() - 1))
+					|| num_pages - i < huge_pages) {
+				i++;
+				continue;
+			}
+			int run = take_run(_mag ? _mag->home : 0, _huge_order);
+			if (run < 0) {
+				break;
+			}
+			COUNT(CNT_HUGE_PAGES, 1);
+			struct pte_t * row = map_page(virtual_addr, proc, 1);
+			row->p_index = run;
+			row->present = 1;
+			row->first = (i == 0);
+			row->last = (i + huge_pages == num_pages);
+			uint32_t j;
+			for (j = 0; j < huge_pages; j++) {
+				frames[i++] = run + j;
+			}
+			small -= huge_pages;
+		}
+		for (; i < num_pages; i++) {
+			frames[i] = -1;
+		}
+		int * taken = (int*)malloc(sizeof(int) * (small + 1));
+		get_frames(taken, small);
+		for(i = 0, small = 0; i < num_pages; i++) {
+			if (frames[i] < 0) {
 				/* Add entries to segment table page tables */
-				uint32_t virtual_addr = ret_mem + i * PAGE_SIZE;
-				uint32_t seg_idx = get_first_lv(virtual_addr);
-				uint32_t page_table_idx = get_second_lv(virtual_addr);
-
-				struct page_table_t* pages = get_page_table(seg_idx, proc->seg_table);
-				if(!pages) {
-					proc->seg_table->table[proc->seg_table->size].v_index = seg_idx;
-					pages = (struct page_table_t*)malloc(
-						sizeof(struct page_table_t)
-					);
-					pages->size = 0;
-					proc->seg_table->table[proc->seg_table->size].pages = pages;
-					proc->seg_table->size++;
-				}
-				
-				pages->table[pages->size].v_index = page_table_idx;
-				pages->table[pages->size].p_index = idx;
-				pages->size++;
-
-				prev = idx;
-				++i;
+				frames[i] = taken[small++];
+				struct pte_t * row = map_page(
+					ret_mem + (addr_t)i * page_size, proc, 0);
+				row->p_index = frames[i];
+				row->present = 1;
+				row->first = (i == 0);
+				row->last = (i == num_pages - 1);
 			}
-			++idx;
+			int idx = frames[i]; // Frame backing page [i]
+			/* Update _mem_stat */
+			_mem_stat[idx].proc = proc->pid;
+			_mem_stat[idx].index = i;
+			_mem_stat[idx].next = -1;
+			_mem_stat[idx].ref = 1;
+			if(i > 0) _mem_stat[prev].next = idx;
+			prev = idx;
 		}
+		free(taken);
+		free(frames);
 	}
 	// dump();
-	pthread_mutex_unlock(&mem_lock);
 	return ret_mem;
 }
 
@@ -195,101 +1145,292 @@ int free_mem(addr_t address, struct pcb_t * proc) {
 	 * 	- Remove unused entries in segment table and page tables of
 	 * 	  the process [proc].
 	 * 	- Remember to use lock to protect the memory from other
-	 * 	  processes.  */
-	pthread_mutex_lock(&mem_lock);
+	 * 	  processes (put_frame() takes care of it).  */
 
-	/* First we need to translate virtual address into physical one.
-	 * Then, get physical index by shift right 0FFSET_LEN */
-	addr_t physical_addr;
-	if(translate(address, &physical_addr, proc) == 0){
-		pthread_mutex_unlock(&mem_lock);
+	if (_swap.fd >= 0) {
+		return swap_free(address, proc);
+	}
+
+	/* First we need to check that [address] starts a region.
+	 * Then walk the pages of the region until the one marked last */
+	address -= get_offset(address);
+	if(!region_start(address, proc)){
 		return 1;
 	}
-		
-	addr_t p_index = physical_addr >> OFFSET_LEN;
 
 	addr_t virtual_addr = address;
-	while(p_index != -1) {
-		int temp = _mem_stat[p_index].next;
-		_mem_stat[p_index].proc = 0;
-		_mem_stat[p_index].index = -1;
-		_mem_stat[p_index].next = - 1;
-		uint32_t seg_idx = get_first_lv(virtual_addr);
-		uint32_t page_table_idx = get_second_lv(virtual_addr);
-		struct page_table_t* pages = get_page_table(seg_idx, proc->seg_table);
-
-		int i = 0;
-		while(pages->table[i].v_index != page_table_idx) {
-			++i;
-		}
-		// for(int j = i; j < pages->size - 1; j++) {
-		// 	pages->table[j].p_index = pages->table[j + 1].p_index;
-		// 	pages->table[j].v_index = pages->table[j + 1].v_index;
-		// }
-		pages->table[i].p_index = pages->table[pages->size - 1].p_index;
-		pages->table[i].v_index = pages->table[pages->size - 1].v_index;
-		
-		pages->size--;
-		
-		if(pages->size == 0) {
-			int i = 0;
-			for(; i < proc->seg_table->size; ++i) {
-				if(proc->seg_table->table[i].v_index == seg_idx) 
-					break;
+	int last = 0;
+	while(!last) {
+		struct pte_t * row = get_row(virtual_addr, proc->seg_table);
+		if (row == NULL) {
+			break;
+		}
+		addr_t p_index = row->p_index;
+		last = row->last;
+		if (row->huge) {
+			/* The whole run goes back at once */
+			uint32_t j;
+			for (j = 0; j < 1U << _huge_order; j++) {
+				_mem_stat[p_index + j].proc = 0;
+				_mem_stat[p_index + j].index = -1;
+				_mem_stat[p_index + j].next = -1;
+				_mem_stat[p_index + j].ref = 0;
+				tlb_invalidate(proc->pid,
+					(virtual_addr >> _offset_bits) + j);
 			}
-			proc->seg_table->table[i] = proc->seg_table->table[
-				proc->seg_table->size - 1
-			];
-			proc->seg_table->size--;
-			free(pages);
+			unmap_page(virtual_addr, proc->seg_table);
+			put_run(p_index, _huge_order);
+			virtual_addr += huge_size();
+			continue;
 		}
-		virtual_addr += PAGE_SIZE;
-		p_index = temp;
+		if (drop_frame(p_index, proc->pid)) {
+			put_frame(p_index);
+		}
+		tlb_invalidate(proc->pid, virtual_addr >> _offset_bits);
+		unmap_page(virtual_addr, proc->seg_table);
+		virtual_addr += _geometry.page_size;
 	}
+	put_range(proc, address, virtual_addr - address);
 
-	pthread_mutex_unlock(&mem_lock);
 	return 0;
 }
 
 int read_mem(addr_t address, struct pcb_t * proc, BYTE * data) {
 	addr_t physical_addr;
-	if (translate(address, &physical_addr, proc)) {
+	if (_swap.fd >= 0) {
+		if (swap_access(address, proc, data, 0) == 0) {
+			return 0;
+		}
+	}else if (lookup(address, &physical_addr, proc, 0)) {
 		*data = _ram[physical_addr];
 		return 0;
-	} else{
-		return 1;
 	}
+	COUNT(CNT_READ_FAILS, 1);
+	return 1;
 }
 
 int write_mem(addr_t address, struct pcb_t * proc, BYTE data) {
 	addr_t physical_addr;
-	if (translate(address, &physical_addr, proc)) {
+	if (_swap.fd >= 0) {
+		if (swap_access(address, proc, &data, 1) == 0) {
+			return 0;
+		}
+	}else if (lookup(address, &physical_addr, proc, 1)) {
 		_ram[physical_addr] = data;
 		return 0;
-	}else{
+	}
+	COUNT(CNT_WRITE_FAILS, 1);
+	return 1;
+}
+
+/* Frames collected by release_table() */
+struct frame_list_t {
+	int * frames;
+	uint32_t count;
+	uint32_t size;
+};
+
+/* Free [table] of level [level] of process [pid] and every table below
+ * it, collecting the frames and swap slots they map. Huge pages go back
+ * right away. Caller must hold the swap lock in swap mode */
+static void release_table(void * table, int level, uint32_t pid,
+		struct frame_list_t * list) {
+	uint64_t i;
+	if (level < _geometry.levels - 1) {
+		struct seg_table_t * seg = (struct seg_table_t*)table;
+		for (i = 0; seg->size > 0; i++) {
+			if (seg->table[i] != NULL) {
+				release_table(seg->table[i], level + 1, pid,
+					list);
+				seg->size--;
+			}
+		}
+		free(seg);
+		return;
+	}
+	struct page_table_t * pages = (struct page_table_t*)table;
+	for (i = 0; pages->size > 0; i++) {
+		struct pte_t * row = &pages->table[i];
+		if (!row->valid) {
+			continue;
+		}
+		pages->size--;
+		if (_swap.fd >= 0) {
+			_swap.used[row->slot] = 0;
+			_swap.num_free++;
+			if (row->slot < _swap.hint) {
+				_swap.hint = row->slot;
+			}
+		}
+		if (!row->present) {
+			continue;
+		}
+		int frame = row->p_index;
+		if (row->huge) {
+			uint32_t j;
+			for (j = 0; j < 1U << _huge_order; j++) {
+				_mem_stat[frame + j].proc = 0;
+				_mem_stat[frame + j].index = -1;
+				_mem_stat[frame + j].next = -1;
+				_mem_stat[frame + j].ref = 0;
+			}
+			put_run(frame, _huge_order);
+			continue;
+		}
+		if (_swap.fd >= 0) {
+			resident_remove(frame);
+			_mem_stat[frame].owner = NULL;
+		}
+		if (!drop_frame(frame, pid)) {
+			continue;
+		}
+		if (list->count == list->size) {
+			list->size = list->size ? list->size * 2 : 64;
+			list->frames = (int*)realloc(list->frames,
+				sizeof(int) * list->size);
+		}
+		list->frames[list->count++] = frame;
+	}
+	free(pages);
+}
+
+static int cmp_frame(const void * a, const void * b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+void release_mem(struct pcb_t * proc) {
+	if (proc->seg_table != NULL) {
+		struct frame_list_t list = {NULL, 0, 0};
+		if (_swap.fd >= 0) {
+			pthread_mutex_lock(&_swap.lock);
+		}
+		release_table(proc->seg_table, 0, proc->pid, &list);
+		if (_swap.fd >= 0) {
+			pthread_mutex_unlock(&_swap.lock);
+		}
+		/* In frame order, each zone is locked once */
+		qsort(list.frames, list.count, sizeof(int), cmp_frame);
+		put_to_zones(list.frames, list.count);
+		__atomic_add_fetch(&_num_free, list.count, __ATOMIC_RELEASE);
+		free(list.frames);
+		proc->seg_table = NULL;
+	}
+	while (proc->free_ranges != NULL) {
+		struct vm_range_t * range = proc->free_ranges;
+		proc->free_ranges = range->next;
+		free(range);
+	}
+	proc->bp = 0;
+	tlb_flush(proc->pid);
+}
+
+/* Copy the table at [slot], of level [level], of a forking process for
+ * its child and share every frame it maps read-only. Huge pages are
+ * split into single pages first, since shared pages are copied one at
+ * a time */
+static void * fork_table(void ** slot, int level) {
+	uint64_t i, n = 1ULL << _bits[level];
+	int found;
+	if (level < _geometry.levels - 1) {
+		struct seg_table_t * seg = (struct seg_table_t*)*slot;
+		struct seg_table_t * copy =
+			(struct seg_table_t*)new_table(level);
+		copy->size = seg->size;
+		for (i = 0, found = 0; found < seg->size; i++) {
+			if (seg->table[i] != NULL) {
+				copy->table[i] =
+					fork_table(&seg->table[i], level + 1);
+				found++;
+			}
+		}
+		return copy;
+	}
+	struct page_table_t * pages = (struct page_table_t*)*slot;
+	if (pages->table[0].huge) {
+		struct pte_t huge = pages->table[0];
+		free(pages);
+		pages = (struct page_table_t*)new_table(level);
+		for (i = 0; i < n; i++) {
+			pages->table[i].p_index = huge.p_index + i;
+			pages->table[i].valid = 1;
+			pages->table[i].present = 1;
+		}
+		pages->table[0].first = huge.first;
+		pages->table[n - 1].last = huge.last;
+		pages->size = n;
+		*slot = pages;
+	}
+	for (i = 0, found = 0; found < pages->size; i++) {
+		struct pte_t * row = &pages->table[i];
+		if (row->valid) {
+			row->cow = 1;
+			__atomic_add_fetch(&_mem_stat[row->p_index].ref, 1,
+				__ATOMIC_RELAXED);
+			found++;
+		}
+	}
+	size_t size = sizeof(struct page_table_t)
+		+ (sizeof(struct pte_t) << _bits[level]);
+	struct page_table_t * copy = (struct page_table_t*)malloc(size);
+	memcpy(copy, pages, size);
+	return copy;
+}
+
+int fork_mem(struct pcb_t * parent, struct pcb_t * child) {
+	if (_swap.fd >= 0) {
 		return 1;
 	}
+	child->seg_table = NULL;
+	child->free_ranges = NULL;
+	child->bp = parent->bp;
+	if (parent->seg_table != NULL) {
+		child->seg_table = (struct seg_table_t*)fork_table(
+			(void**)&parent->seg_table, 0);
+		/* Pages of [parent] are read-only from now on */
+		tlb_flush(parent->pid);
+	}
+	struct vm_range_t * range;
+	struct vm_range_t ** link = &child->free_ranges;
+	for (range = parent->free_ranges; range != NULL; range = range->next) {
+		*link = (struct vm_range_t*)malloc(sizeof(struct vm_range_t));
+		(*link)->start = range->start;
+		(*link)->size = range->size;
+		(*link)->next = NULL;
+		link = &(*link)->next;
+	}
+	return 0;
+}
+
+uint32_t owned_frames(uint32_t pid) {
+	uint32_t count = 0;
+	int i;
+	for (i = 0; i < _num_pages; i++) {
+		if (_mem_stat[i].proc != 0
+				&& (pid == 0 || _mem_stat[i].proc == pid)) {
+			count++;
+		}
+	}
+	return count;
 }
 
 void dump(void) {
 	int i;
-	for (i = 0; i < NUM_PAGES; i++) {
+	for (i = 0; i < _num_pages; i++) {
 		if (_mem_stat[i].proc != 0) {
+			uint64_t begin = (uint64_t)i << _offset_bits;
+			uint64_t end = begin + _geometry.page_size;
 			printf("%03d: ", i);
-			printf("%05x-%05x - PID: %02d (idx %03d, nxt: %03d)\n",
-				i << OFFSET_LEN,
-				((i + 1) << OFFSET_LEN) - 1,
+			printf("%05lx-%05lx - PID: %02d (idx %03d, nxt: %03d)\n",
+				begin,
+				end - 1,
 				_mem_stat[i].proc,
 				_mem_stat[i].index,
 				_mem_stat[i].next
 			);
-			int j;
-			for (	j = i << OFFSET_LEN;
-				j < ((i+1) << OFFSET_LEN) - 1;
-				j++) {
-				
+			uint64_t j;
+			for (j = begin; j < end - 1; j++) {
 				if (_ram[j] != 0) {
-					printf("\t%05x: %02x\n", j, _ram[j]);
+					printf("\t%05lx: %02x\n", j, _ram[j]);
 				}
 					
 			}
@@ -297,4 +1438,36 @@ void dump(void) {
 	}
 }
 
+void init_swap(const char * path, int slots, enum swap_policy_t policy) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || slots <= 0
+			|| ftruncate(fd, (off_t)slots * _geometry.page_size)) {
+		printf("Cannot create swap file of %d pages at %s\n",
+			slots, path);
+		exit(1);
+	}
+	_swap.used = (uint8_t*)calloc(slots, sizeof(uint8_t));
+	_swap.prev = (int*)calloc(_num_pages, sizeof(int));
+	_swap.next = (int*)calloc(_num_pages, sizeof(int));
+	_swap.age = (uint8_t*)calloc(_num_pages, sizeof(uint8_t));
+	_swap.slots = slots;
+	_swap.num_free = slots;
+	_swap.hint = 0;
+	_swap.policy = policy;
+	_swap.head = -1;
+	_swap.tail = -1;
+	_swap.fd = fd;
+}
+
+void swap_report(void) {
+	static const char * name[] = {"FIFO", "Clock", "LRU"};
+	if (_swap.fd < 0) {
+		return;
+	}
+	fprintf(stderr, "Swap: %d pages, %s replacement\n",
+		_swap.slots, name[_swap.policy]);
+	fprintf(stderr, "\t%lu page faults (%lu zero-filled), "
+		"%lu evictions, %lu written back\n", _swap.faults,
+		_swap.zero_fills, _swap.evictions, _swap.writebacks);
+}
 
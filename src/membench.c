@@ -0,0 +1,310 @@
+
+/* Memory subsystem microbenchmark. Threads act as CPUs running one
+ * process each, and call alloc_mem(), free_mem(), read_mem() and
+ * write_mem() directly, without the scheduler or the timer */
+
+#include "mem.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_REGIONS	16	// Regions a thread holds at most
+
+enum op_t {OP_ALLOC, OP_FREE, OP_READ, OP_WRITE, NUM_OPS};
+
+static const char * op_name[NUM_OPS] = {"alloc", "free", "read", "write"};
+
+static struct {
+	int num_threads;
+	long ops;		// Operations per thread
+	int sequential;		// Access pattern of reads and writes
+	uint32_t size_lo, size_hi;
+	int fragment;		// Percent of frames held in a checkerboard
+	int mix[NUM_OPS];
+	uint64_t seed;
+} opt = {1, 100000, 0, 128, 8192, 0, {10, 10, 40, 40}, 1};
+
+struct worker_t {
+	pthread_t thread;
+	int id;
+	uint64_t rng;
+	uint64_t * latency[NUM_OPS];	// Nanoseconds of each operation
+	long count[NUM_OPS];
+	long failed_allocs;
+	long recycled;		// Processes which ran out of address space
+};
+
+static uint32_t next_pid = 1;
+
+static uint64_t rng(uint64_t * state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct pcb_t * new_proc(void) {
+	struct pcb_t * proc = (struct pcb_t*)calloc(1, sizeof(struct pcb_t));
+	proc->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
+	proc->last_cpu = -1;
+	return proc;
+}
+
+static void free_proc(struct pcb_t * proc, addr_t * addr, int n) {
+	memset(addr, 0, sizeof(addr_t) * n);
+	release_mem(proc);
+	free(proc);
+}
+
+static enum op_t pick_op(uint64_t * state) {
+	int total = 0, i;
+	for (i = 0; i < NUM_OPS; i++) {
+		total += opt.mix[i];
+	}
+	int r = rng(state) % total;
+	for (i = 0; i < NUM_OPS - 1; i++) {
+		if ((r -= opt.mix[i]) < 0) {
+			break;
+		}
+	}
+	return (enum op_t)i;
+}
+
+static void * worker_routine(void * args) {
+	struct worker_t * w = (struct worker_t*)args;
+	attach_mem(w->id);
+	struct pcb_t * proc = new_proc();
+	addr_t addr[NUM_REGIONS] = {0};
+	uint32_t size[NUM_REGIONS] = {0};
+	int live = 0;
+	uint32_t cursor = 0;	// Next byte for sequential accesses
+	int region = 0;		// Region sequential accesses sweep
+	long i;
+	for (i = 0; i < opt.ops; i++) {
+		enum op_t op = pick_op(&w->rng);
+		if (op == OP_ALLOC && live == NUM_REGIONS) {
+			op = OP_FREE;
+		}else if (op != OP_ALLOC && live == 0) {
+			op = OP_ALLOC;
+		}
+		/* A live region to work on */
+		int r = rng(&w->rng) % NUM_REGIONS;
+		while ((addr[r] != 0) != (op != OP_ALLOC)) {
+			r = (r + 1) % NUM_REGIONS;
+		}
+		uint32_t offset = 0;
+		if (op == OP_READ || op == OP_WRITE) {
+			if (opt.sequential) {
+				while (addr[region] == 0) {
+					region = (region + 1) % NUM_REGIONS;
+				}
+				if (cursor >= size[region]) {
+					cursor = 0;
+					do {
+						region = (region + 1)
+							% NUM_REGIONS;
+					} while (addr[region] == 0);
+				}
+				r = region;
+				offset = cursor++;
+			}else{
+				offset = rng(&w->rng) % size[r];
+			}
+		}
+		uint32_t bytes = opt.size_lo + rng(&w->rng)
+			% (opt.size_hi - opt.size_lo + 1);
+
+		BYTE data;
+		uint64_t start = now_ns();
+		switch (op) {
+		case OP_ALLOC:
+			addr[r] = alloc_mem(bytes, proc);
+			break;
+		case OP_FREE:
+			free_mem(addr[r], proc);
+			break;
+		case OP_READ:
+			read_mem(addr[r] + offset, proc, &data);
+			break;
+		case OP_WRITE:
+			write_mem(addr[r] + offset, proc, (BYTE)i);
+			break;
+		default:
+			break;
+		}
+		w->latency[op][w->count[op]++] = now_ns() - start;
+
+		if (op == OP_ALLOC) {
+			if (addr[r] != 0) {
+				size[r] = bytes;
+				live++;
+			}else if (proc->bp + bytes
+					> 1ULL << mem_geometry()->address_bits) {
+				/* Address space used up: start a new process */
+				free_proc(proc, addr, NUM_REGIONS);
+				proc = new_proc();
+				live = 0;
+				w->recycled++;
+			}else{
+				w->failed_allocs++;
+			}
+		}else if (op == OP_FREE) {
+			addr[r] = 0;
+			live--;
+		}
+	}
+	free_proc(proc, addr, NUM_REGIONS);
+	return NULL;
+}
+
+/* Hold [percent] of the frames with a process owning every other one,
+ * so that free frames are scattered over the whole memory */
+static void fragment(int percent) {
+	const struct mem_geometry_t * g = mem_geometry();
+	int pages = g->ram_size / g->page_size * percent / 100;
+	if (pages == 0) {
+		return;
+	}
+	struct pcb_t * proc = new_proc();
+	addr_t * addr = (addr_t*)calloc(pages * 2, sizeof(addr_t));
+	int i;
+	for (i = 0; i < pages * 2 && (addr[i] = alloc_mem(1, proc)); i++);
+	for (i = 0; i < pages * 2; i += 2) {
+		if (addr[i] != 0) {
+			free_mem(addr[i], proc);
+		}
+	}
+	/* The process keeps its odd pages until exit */
+	free(addr);
+}
+
+static int cmp_u64(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t rank(const uint64_t * v, long n, int pct) {
+	long i = (n * pct + 99) / 100;
+	return n == 0 ? 0 : v[i > 0 ? i - 1 : 0];
+}
+
+static void usage(void) {
+	printf("Usage: membench [options]\n"
+		"\t-t threads\tnumber of threads (1)\n"
+		"\t-n ops\t\toperations per thread (100000)\n"
+		"\t-p random|sequential\n"
+		"\t\t\taccess pattern of reads and writes (random)\n"
+		"\t-z lo-hi\tallocation size range in bytes (128-8192)\n"
+		"\t-f percent\tframes held in a checkerboard beforehand (0)\n"
+		"\t-m a,f,r,w\talloc/free/read/write weights (10,10,40,40)\n"
+		"\t-s seed\t\trandom seed (1)\n");
+	exit(1);
+}
+
+int main(int argc, char * argv[]) {
+	int c;
+	while ((c = getopt(argc, argv, "t:n:p:z:f:m:s:")) != -1) {
+		switch (c) {
+		case 't': opt.num_threads = atoi(optarg); break;
+		case 'n': opt.ops = atol(optarg); break;
+		case 'f': opt.fragment = atoi(optarg); break;
+		case 's': opt.seed = strtoull(optarg, NULL, 0); break;
+		case 'p':
+			if (!strcmp(optarg, "sequential")) {
+				opt.sequential = 1;
+			}else if (strcmp(optarg, "random")) {
+				usage();
+			}
+			break;
+		case 'z':
+			if (sscanf(optarg, "%u-%u", &opt.size_lo,
+					&opt.size_hi) != 2) {
+				usage();
+			}
+			break;
+		case 'm':
+			if (sscanf(optarg, "%d,%d,%d,%d", &opt.mix[OP_ALLOC],
+					&opt.mix[OP_FREE], &opt.mix[OP_READ],
+					&opt.mix[OP_WRITE]) != 4) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (opt.num_threads < 1 || opt.ops < 1 || opt.size_lo < 1
+			|| opt.size_lo > opt.size_hi || opt.fragment < 0
+			|| opt.fragment > 50 || opt.mix[OP_ALLOC] < 1) {
+		usage();
+	}
+
+	init_mem(NULL);
+	fragment(opt.fragment);
+
+	struct worker_t * w = (struct worker_t*)calloc(opt.num_threads,
+		sizeof(struct worker_t));
+	int i, op;
+	for (i = 0; i < opt.num_threads; i++) {
+		w[i].id = i;
+		w[i].rng = (opt.seed ? opt.seed : 1) * (i + 1)
+			* 0x9e3779b97f4a7c15ULL;
+		for (op = 0; op < NUM_OPS; op++) {
+			w[i].latency[op] =
+				(uint64_t*)malloc(sizeof(uint64_t) * opt.ops);
+		}
+	}
+	uint64_t start = now_ns();
+	for (i = 0; i < opt.num_threads; i++) {
+		pthread_create(&w[i].thread, NULL, worker_routine, &w[i]);
+	}
+	for (i = 0; i < opt.num_threads; i++) {
+		pthread_join(w[i].thread, NULL);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	printf("membench: %d threads, %s, %u-%u bytes, %d%% fragmented\n",
+		opt.num_threads, opt.sequential ? "sequential" : "random",
+		opt.size_lo, opt.size_hi, opt.fragment);
+	printf("\t%-6s %10s %12s %8s %8s %8s %8s\n", "op", "count", "ops/s",
+		"p50 ns", "p90 ns", "p99 ns", "max ns");
+	long total = 0, failed = 0, recycled = 0;
+	for (op = 0; op < NUM_OPS; op++) {
+		long n = 0;
+		for (i = 0; i < opt.num_threads; i++) {
+			n += w[i].count[op];
+		}
+		uint64_t * all = (uint64_t*)malloc(sizeof(uint64_t) * (n + 1));
+		long k = 0;
+		for (i = 0; i < opt.num_threads; i++) {
+			memcpy(all + k, w[i].latency[op],
+				sizeof(uint64_t) * w[i].count[op]);
+			k += w[i].count[op];
+		}
+		qsort(all, n, sizeof(uint64_t), cmp_u64);
+		printf("\t%-6s %10ld %12.0f %8lu %8lu %8lu %8lu\n",
+			op_name[op], n, n / elapsed, rank(all, n, 50),
+			rank(all, n, 90), rank(all, n, 99),
+			n ? all[n - 1] : 0);
+		total += n;
+		free(all);
+	}
+	for (i = 0; i < opt.num_threads; i++) {
+		failed += w[i].failed_allocs;
+		recycled += w[i].recycled;
+	}
+	printf("\t%ld ops in %.3f s, %.0f ops/s, %ld failed allocations, "
+		"%ld address spaces used up\n",
+		total, elapsed, total / elapsed, failed, recycled);
+	return 0;
+}
+
@@ -0,0 +1,231 @@
+
+#include "metrics.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Counters of a CPU, only updated by the thread running it. Padded so
+ * that CPUs do not share cache lines */
+static struct cpu_metrics_t {
+	uint64_t busy;		// Time slots spent running processes
+	uint64_t dispatches;
+	char pad[48];
+} * cpus = NULL;
+static int num_cpus = 0;
+
+/* Life cycle of finished processes */
+static struct proc_metrics_t {
+	uint32_t pid;
+	uint32_t priority;
+	uint64_t arrival;
+	uint64_t first_dispatch;
+	uint64_t completion;
+	uint64_t runtime;
+	uint32_t preemptions;
+	uint32_t migrations;
+} * procs = NULL;
+static int num_procs = 0;
+static int max_procs = 0;
+static pthread_mutex_t procs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_metrics(int n) {
+	num_cpus = n;
+	cpus = (struct cpu_metrics_t*)calloc(n, sizeof(struct cpu_metrics_t));
+}
+
+void metrics_arrive(struct pcb_t * proc) {
+	proc->arrival_time = current_time();
+	proc->first_dispatch = UINT64_MAX;
+}
+
+void metrics_dispatch(struct pcb_t * proc, int cpu) {
+	if (proc->first_dispatch == UINT64_MAX) {
+		proc->first_dispatch = proc->dispatch_time;
+	}
+	cpus[cpu].dispatches++;
+}
+
+void metrics_leave(struct pcb_t * proc, int cpu, int finished) {
+	uint64_t now = current_time();
+	cpus[cpu].busy += now - proc->dispatch_time;
+	if (!finished) {
+		proc->preemptions++;
+		return;
+	}
+	pthread_mutex_lock(&procs_lock);
+	if (num_procs == max_procs) {
+		max_procs = max_procs ? 2 * max_procs : 16;
+		procs = realloc(procs, sizeof(*procs) * max_procs);
+	}
+	struct proc_metrics_t * m = &procs[num_procs++];
+	m->pid = proc->pid;
+	m->priority = proc->priority;
+	m->arrival = proc->arrival_time;
+	m->first_dispatch = proc->first_dispatch;
+	m->completion = now;
+	m->runtime = proc->runtime;
+	m->preemptions = proc->preemptions;
+	m->migrations = proc->migrations;
+	pthread_mutex_unlock(&procs_lock);
+}
+
+/* Average and nearest-rank percentiles of [n] values */
+struct summary_t {
+	const char * name;
+	double avg;
+	uint64_t p50, p90, p99, max;
+};
+
+static int cmp_u64(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t rank(const uint64_t * v, int n, int pct) {
+	int i = (n * pct + 99) / 100;
+	return v[i > 0 ? i - 1 : 0];
+}
+
+static struct summary_t summarize(const char * name, uint64_t * v, int n) {
+	struct summary_t s = {name, 0, 0, 0, 0, 0};
+	if (n == 0) {
+		return s;
+	}
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+	int i;
+	for (i = 0; i < n; i++) {
+		s.avg += v[i];
+	}
+	s.avg /= n;
+	s.p50 = rank(v, n, 50);
+	s.p90 = rank(v, n, 90);
+	s.p99 = rank(v, n, 99);
+	s.max = v[n - 1];
+	return s;
+}
+
+#define NUM_SUMMARIES	3
+
+static void write_csv(FILE * file, uint64_t makespan, double throughput,
+		const struct summary_t * s) {
+	int i;
+	fprintf(file, "metric,value\n");
+	fprintf(file, "processes,%d\n", num_procs);
+	fprintf(file, "makespan,%lu\n", makespan);
+	fprintf(file, "throughput,%.6f\n", throughput);
+	for (i = 0; i < NUM_SUMMARIES; i++) {
+		fprintf(file, "%s_avg,%.3f\n", s[i].name, s[i].avg);
+		fprintf(file, "%s_p50,%lu\n", s[i].name, s[i].p50);
+		fprintf(file, "%s_p90,%lu\n", s[i].name, s[i].p90);
+		fprintf(file, "%s_p99,%lu\n", s[i].name, s[i].p99);
+		fprintf(file, "%s_max,%lu\n", s[i].name, s[i].max);
+	}
+	for (i = 0; i < num_cpus; i++) {
+		uint64_t idle = makespan > cpus[i].busy ?
+			makespan - cpus[i].busy : 0;
+		fprintf(file, "cpu%d_busy,%lu\n", i, cpus[i].busy);
+		fprintf(file, "cpu%d_idle,%lu\n", i, idle);
+		fprintf(file, "cpu%d_dispatches,%lu\n", i, cpus[i].dispatches);
+	}
+}
+
+static void write_json(FILE * file, uint64_t makespan, double throughput,
+		const struct summary_t * s) {
+	int i;
+	fprintf(file, "{\n\t\"processes\": %d,\n", num_procs);
+	fprintf(file, "\t\"makespan\": %lu,\n", makespan);
+	fprintf(file, "\t\"throughput\": %.6f,\n", throughput);
+	for (i = 0; i < NUM_SUMMARIES; i++) {
+		fprintf(file, "\t\"%s\": {\"avg\": %.3f, \"p50\": %lu, "
+			"\"p90\": %lu, \"p99\": %lu, \"max\": %lu},\n",
+			s[i].name, s[i].avg, s[i].p50, s[i].p90,
+			s[i].p99, s[i].max);
+	}
+	fprintf(file, "\t\"cpus\": [");
+	for (i = 0; i < num_cpus; i++) {
+		uint64_t idle = makespan > cpus[i].busy ?
+			makespan - cpus[i].busy : 0;
+		fprintf(file, "%s\n\t\t{\"cpu\": %d, \"busy\": %lu, "
+			"\"idle\": %lu, \"dispatches\": %lu}",
+			i ? "," : "", i, cpus[i].busy, idle,
+			cpus[i].dispatches);
+	}
+	fprintf(file, "\n\t],\n\t\"process_list\": [");
+	for (i = 0; i < num_procs; i++) {
+		struct proc_metrics_t * m = &procs[i];
+		fprintf(file, "%s\n\t\t{\"pid\": %u, \"priority\": %u, "
+			"\"arrival\": %lu, \"first_dispatch\": %lu, "
+			"\"completion\": %lu, \"runtime\": %lu, "
+			"\"preemptions\": %u, \"migrations\": %u}",
+			i ? "," : "", m->pid, m->priority, m->arrival,
+			m->first_dispatch, m->completion, m->runtime,
+			m->preemptions, m->migrations);
+	}
+	fprintf(file, "\n\t]\n}\n");
+}
+
+void finish_metrics(const char * path) {
+	uint64_t * v = (uint64_t*)malloc(
+		sizeof(uint64_t) * NUM_SUMMARIES * (num_procs + 1));
+	uint64_t * turnaround = v;
+	uint64_t * waiting = v + num_procs;
+	uint64_t * response = v + 2 * num_procs;
+	uint64_t makespan = 0;
+	int i;
+	for (i = 0; i < num_procs; i++) {
+		struct proc_metrics_t * m = &procs[i];
+		turnaround[i] = m->completion - m->arrival;
+		waiting[i] = turnaround[i] > m->runtime ?
+			turnaround[i] - m->runtime : 0;
+		response[i] = m->first_dispatch - m->arrival;
+		if (m->completion > makespan) {
+			makespan = m->completion;
+		}
+	}
+	struct summary_t s[NUM_SUMMARIES] = {
+		summarize("turnaround", turnaround, num_procs),
+		summarize("waiting", waiting, num_procs),
+		summarize("response", response, num_procs)
+	};
+	double throughput = makespan ? (double)num_procs / makespan : 0.0;
+
+	fprintf(stderr, "Scheduling metrics: %d processes in %lu time slots, "
+		"%.3f processes per slot\n", num_procs, makespan, throughput);
+	fprintf(stderr, "\t%-10s %8s %6s %6s %6s %6s\n",
+		"", "avg", "p50", "p90", "p99", "max");
+	for (i = 0; i < NUM_SUMMARIES; i++) {
+		fprintf(stderr, "\t%-10s %8.1f %6lu %6lu %6lu %6lu\n",
+			s[i].name, s[i].avg, s[i].p50, s[i].p90,
+			s[i].p99, s[i].max);
+	}
+	for (i = 0; i < num_cpus; i++) {
+		uint64_t idle = makespan > cpus[i].busy ?
+			makespan - cpus[i].busy : 0;
+		fprintf(stderr, "\tCPU %d: %lu busy, %lu idle slots "
+			"(%.1f%% utilisation), %lu dispatches\n",
+			i, cpus[i].busy, idle,
+			makespan ? 100.0 * cpus[i].busy / makespan : 0.0,
+			cpus[i].dispatches);
+	}
+
+	if (path != NULL) {
+		FILE * file;
+		if ((file = fopen(path, "w")) == NULL) {
+			fprintf(stderr, "Cannot write metrics to %s\n", path);
+		}else{
+			size_t len = strlen(path);
+			if (len >= 5 && !strcmp(path + len - 5, ".json")) {
+				write_json(file, makespan, throughput, s);
+			}else{
+				write_csv(file, makespan, throughput, s);
+			}
+			fclose(file);
+		}
+	}
+	free(v);
+	free(procs);
+	free(cpus);
+}
+
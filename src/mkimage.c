@@ -0,0 +1,20 @@
+
+#include "loader.h"
+#include <stdio.h>
+
+/* Compile text process descriptions into images that load() can map
+ * directly: mkimage <source> <image> [<source> <image> ...] */
+int main(int argc, char * argv[]) {
+	if (argc < 3 || argc % 2 == 0) {
+		printf("Usage: mkimage <source> <image> [<source> <image> ...]\n");
+		return 1;
+	}
+	int i;
+	for (i = 1; i < argc; i += 2) {
+		if (compile_image(argv[i], argv[i + 1])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
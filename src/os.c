@@ -1,18 +1,33 @@
 
 #include "cpu.h"
+#include "instrument.h"
 #include "timer.h"
 #include "sched.h"
 #include "loader.h"
+#include "metrics.h"
 #include "mem.h"
+#include "tlb.h"
+#include "trace.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
+static int batch = 0;	// Run CALC instructions without the timer
+static char * trace_path = NULL;	// Binary trace file, text if NULL
+static char * metrics_path = NULL;	// CSV or JSON metrics, if any
+static uint64_t num_instructions = 0;	// Run by every CPU
+static char * swap_path = NULL;	// Swap file, no swap if NULL
+static int swap_slots;
+static enum swap_policy_t swap_policy;
+static struct mem_geometry_t geometry = {DEFAULT_RAM_SIZE,
+	DEFAULT_PAGE_SIZE, DEFAULT_ADDRESS_BITS, DEFAULT_LEVELS};
+static struct sched_config_t sched_config;
 
 static struct ld_args{
 	char ** path;
@@ -30,75 +45,115 @@ static void * cpu_routine(void * args) {
 	int id = ((struct cpu_args*)args)->id;
 	/* Check for new process in ready queue */
 	int time_left = 0;
+	uint64_t ran_total = 0;
 	struct pcb_t * proc = NULL;
+	attach_mem(id);
 	while (1) {
 		/* Check the status of current process */
 		if (proc == NULL) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
-			proc = get_proc();
+			proc = get_proc(id);
 		}else if (proc->pc == proc->code->size) {
 			/* The porcess has finish it job */
-			printf("\tCPU %d: Processed %2d has finished\n",
-				id ,proc->pid);
+			trace_event(TRACE_FINISH, id, proc->pid);
+			finish_proc(proc, id);
+			release_mem(proc);
+			release_code(proc->code);
 			free(proc);
-			proc = get_proc();
+			proc = get_proc(id);
 			time_left = 0;
 		}else if (time_left == 0) {
 			/* The process has done its job in current time slot */
-			printf("\tCPU %d: Put process %2d to run queue\n",
-				id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
+			trace_event(TRACE_PUT, id, proc->pid);
+			put_proc(proc, id);
+			proc = get_proc(id);
 		}
 		
 		/* Recheck process status after loading new process */
 		if (proc == NULL && done) {
 			/* No process to run, exit */
-			printf("\tCPU %d stopped\n", id);
+			trace_event(TRACE_STOP, id, 0);
 			break;
 		}else if (proc == NULL) {
 			/* There may be new processes to run in
 			 * next time slots, just skip current slot */
-			next_slot(timer_id);
+			idle_slot(timer_id);
 			continue;
 		}else if (time_left == 0) {
-			printf("\tCPU %d: Dispatched process %2d\n",
-				id, proc->pid);
-			time_left = time_slot;
+			trace_event(TRACE_DISPATCH, id, proc->pid);
+			time_left = time_slice(proc, id);
+			/* Warm up caches of a process coming from
+			 * another CPU */
+			int stall = dispatch_penalty(proc, id);
+			if (stall > 0) {
+				sleep_until(timer_id, current_time() + stall);
+			}
 		}
 		
 		/* Run current process */
+		if (batch) {
+			/* CALC instructions only touch the process itself,
+			 * so a run of them can go without meeting the other
+			 * devices every slot. Anything else goes first in a
+			 * batch so that it still runs in its own slot */
+			int ran = 0;
+			do {
+				run(proc);
+				time_left--;
+				ran++;
+				ran_total++;
+			} while (time_left > 0 && proc->pc < proc->code->size
+				&& proc->code->text[proc->pc].opcode == CALC);
+			sleep_until(timer_id, current_time() + ran);
+			continue;
+		}
 		run(proc);
 		time_left--;
+		ran_total++;
 		next_slot(timer_id);
 	}
+	__atomic_add_fetch(&num_instructions, ran_total, __ATOMIC_RELAXED);
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+/* FORK handler: the child competes for CPUs right away */
+static void spawn(struct pcb_t * parent, struct pcb_t * child) {
+	trace_fork(parent->last_cpu, parent->pid, child->pid);
+	add_proc(child);
+}
+
 static void * ld_routine(void * args) {
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 	int i = 0;
 	while (i < num_processes) {
 		struct pcb_t * proc = load(ld_processes.path[i]);
-		while (current_time() < ld_processes.start_time[i]) {
-			next_slot(timer_id);
-		}
-		printf("\tLoaded a process at %s, PID: %d\n",
-			ld_processes.path[i], proc->pid);
+		/* Nothing to do until the process arrives */
+		sleep_until(timer_id, ld_processes.start_time[i]);
+		trace_load(proc->pid, ld_processes.path[i]);
 		add_proc(proc);
-		free(ld_processes.path[i]);
 		i++;
 		next_slot(timer_id);
 	}
-	free(ld_processes.path);
-	free(ld_processes.start_time);
 	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+/* Read a size such as 4096, 64K, 16M or 1G */
+static uint64_t read_size(FILE * file) {
+	uint64_t size = 0;
+	char unit = '\0';
+	fscanf(file, "%lu%c", &size, &unit);
+	switch (unit) {
+	case 'G': case 'g': return size << 30;
+	case 'M': case 'm': return size << 20;
+	case 'K': case 'k': return size << 10;
+	default: return size;
+	}
+}
+
 static void read_config(const char * path) {
 	FILE * file;
 	if ((file = fopen(path, "r")) == NULL) {
@@ -118,6 +173,144 @@ static void read_config(const char * path) {
 		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
 		strcat(ld_processes.path[i], proc);
 	}
+
+	/* Optional settings may follow the process list, one per line in
+	 * the form "<option> <values>" */
+	char option[32];
+	while (fscanf(file, "%31s", option) == 1) {
+		if (!strcmp(option, "tlb")) {
+			/* tlb <entries> <ways> */
+			int entries, ways;
+			fscanf(file, "%d %d\n", &entries, &ways);
+			init_tlb(entries, ways);
+		}else if (!strcmp(option, "runqueue")) {
+			/* runqueue global|percpu */
+			char mode[32];
+			fscanf(file, "%31s\n", mode);
+			if (!strcmp(mode, "percpu")) {
+				sched_config.per_cpu = 1;
+			}else if (!strcmp(mode, "global")) {
+				sched_config.per_cpu = 0;
+			}else{
+				printf("Unknown run queue mode '%s'\n", mode);
+				exit(1);
+			}
+		}else if (!strcmp(option, "policy")) {
+			/* policy prio|mlfq|cfs */
+			char name[32];
+			fscanf(file, "%31s\n", name);
+			if (!strcmp(name, "prio")) {
+				sched_config.policy = SCHED_PRIO;
+			}else if (!strcmp(name, "mlfq")) {
+				sched_config.policy = SCHED_MLFQ;
+			}else if (!strcmp(name, "cfs")) {
+				sched_config.policy = SCHED_CFS;
+			}else{
+				printf("Unknown policy '%s'\n", name);
+				exit(1);
+			}
+		}else if (!strcmp(option, "mlfq")) {
+			/* mlfq <levels> <boost period> <quantum 0> ... */
+			fscanf(file, "%d %d", &sched_config.mlfq_levels,
+				&sched_config.mlfq_boost);
+			if (sched_config.mlfq_levels < 1 ||
+				sched_config.mlfq_levels > MLFQ_MAX_LEVELS) {
+				printf("MLFQ needs 1 to %d levels\n",
+					MLFQ_MAX_LEVELS);
+				exit(1);
+			}
+			for (i = 0; i < sched_config.mlfq_levels; i++) {
+				fscanf(file, "%d",
+					&sched_config.mlfq_quantum[i]);
+				if (sched_config.mlfq_quantum[i] < 1) {
+					printf("MLFQ quanta must be positive\n");
+					exit(1);
+				}
+			}
+			sched_config.policy = SCHED_MLFQ;
+		}else if (!strcmp(option, "cfs")) {
+			/* cfs <latency> <granularity> */
+			fscanf(file, "%d %d\n", &sched_config.cfs_latency,
+				&sched_config.cfs_granularity);
+			if (sched_config.cfs_granularity < 1
+				|| sched_config.cfs_latency < 1) {
+				printf("CFS latency and granularity must "
+					"be positive\n");
+				exit(1);
+			}
+			sched_config.policy = SCHED_CFS;
+		}else if (!strcmp(option, "batch")) {
+			/* batch on|off */
+			char mode[32];
+			fscanf(file, "%31s\n", mode);
+			if (!strcmp(mode, "on")) {
+				batch = 1;
+			}else if (!strcmp(mode, "off")) {
+				batch = 0;
+			}else{
+				printf("Unknown batch mode '%s'\n", mode);
+				exit(1);
+			}
+		}else if (!strcmp(option, "trace")) {
+			/* trace text|<path of binary trace file> */
+			char mode[100];
+			fscanf(file, "%99s\n", mode);
+			free(trace_path);
+			trace_path = strcmp(mode, "text") ? strdup(mode) : NULL;
+		}else if (!strcmp(option, "metrics")) {
+			/* metrics <path of .csv or .json file> */
+			char name[100];
+			fscanf(file, "%99s\n", name);
+			free(metrics_path);
+			metrics_path = strdup(name);
+		}else if (!strcmp(option, "swap")) {
+			/* swap <path> <pages> fifo|clock|lru */
+			char name[100], policy[32];
+			fscanf(file, "%99s %d %31s\n", name, &swap_slots,
+				policy);
+			if (!strcmp(policy, "fifo")) {
+				swap_policy = SWAP_FIFO;
+			}else if (!strcmp(policy, "clock")) {
+				swap_policy = SWAP_CLOCK;
+			}else if (!strcmp(policy, "lru")) {
+				swap_policy = SWAP_LRU;
+			}else{
+				printf("Unknown replacement policy '%s'\n",
+					policy);
+				exit(1);
+			}
+			free(swap_path);
+			swap_path = strdup(name);
+		}else if (!strcmp(option, "memory")) {
+			/* memory <RAM size> <page size> <address bits>
+			 * <levels of page tables> */
+			geometry.ram_size = read_size(file);
+			geometry.page_size = read_size(file);
+			fscanf(file, "%d %d\n", &geometry.address_bits,
+				&geometry.levels);
+		}else if (!strcmp(option, "migration")) {
+			/* migration <cost in time slots> */
+			fscanf(file, "%d\n", &sched_config.migration_cost);
+		}else{
+			printf("Unknown option '%s' in %s\n", option, path);
+			exit(1);
+		}
+	}
+	fclose(file);
+
+	sched_config.time_slot = time_slot;
+	if (sched_config.mlfq_levels == 0) {
+		/* Default MLFQ: quanta double at each level */
+		sched_config.mlfq_levels = 3;
+		for (i = 0; i < sched_config.mlfq_levels; i++) {
+			sched_config.mlfq_quantum[i] = time_slot << i;
+		}
+		sched_config.mlfq_boost = 20 * time_slot;
+	}
+	if (sched_config.cfs_latency == 0) {
+		sched_config.cfs_latency = 4 * time_slot;
+		sched_config.cfs_granularity = 1;
+	}
 }
 
 int main(int argc, char * argv[]) {
@@ -144,12 +337,24 @@ int main(int argc, char * argv[]) {
 		args[i].id = i;
 	}
 	struct timer_id_t * ld_event = attach_event();
+	start_trace(trace_path);
 	start_timer();
 
 	/* Init scheduler */
-	init_scheduler();
+	sched_config.num_cpus = num_cpus;
+	init_scheduler(&sched_config);
+	init_metrics(num_cpus);
+	set_spawn_handler(spawn);
+
+	/* Init physical memory */
+	init_mem(&geometry);
+	if (swap_path != NULL) {
+		init_swap(swap_path, swap_slots, swap_policy);
+	}
 
 	/* Run CPU and loader */
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	pthread_create(&ld, NULL, ld_routine, (void*)ld_event);
 	for (i = 0; i < num_cpus; i++) {
 		pthread_create(&cpu[i], NULL,
@@ -164,11 +369,34 @@ int main(int argc, char * argv[]) {
 
 	/* Stop timer */
 	stop_timer();
+	stop_trace();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (i = 0; i < num_processes; i++) {
+		free(ld_processes.path[i]);
+	}
+	free(ld_processes.path);
+	free(ld_processes.start_time);
 
 	printf("\nMEMORY CONTENT: \n");
 	dump();
+	/* Every process has finished, so none may still own a frame */
+	uint32_t leaked = owned_frames(0);
+	if (leaked > 0) {
+		fprintf(stderr, "%u frames still owned by finished "
+			"processes\n", leaked);
+	}
+
+	finish_scheduler();
+	finish_metrics(metrics_path);
+	tlb_report();
+	swap_report();
+	instrument_report();
+	fprintf(stderr, "Simulated %lu time slots, %lu instructions "
+		"in %.3f s\n", current_time(), num_instructions,
+		(end.tv_sec - start.tv_sec)
+			+ (end.tv_nsec - start.tv_nsec) / 1e9);
 
-	return 0;
+	return leaked > 0;
 
 }
 
@@ -1,21 +1,41 @@
 
 #include "mem.h"
 #include "cpu.h" 
+#include "instrument.h"
 #include "loader.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+static struct pcb_t ** children = NULL;
+static int num_children = 0;
+
+/* FORK handler: with no scheduler, children run after their parent */
+static void spawn(struct pcb_t * parent, struct pcb_t * child) {
+	children = (struct pcb_t**)realloc(children,
+		(num_children + 1) * sizeof(struct pcb_t*));
+	children[num_children++] = child;
+}
+
 int main(int argc, char ** argv) {
 	if (argc < 2) {
 		printf("Cannot find input process\n");
 		exit(1);
 	}
+	init_mem(NULL);
+	set_spawn_handler(spawn);
 	struct pcb_t * proc = load(argv[1]);
 	unsigned int i;
 	for (i = 0; i < proc->code->size; i++) {
 		run(proc);
 	}
+	int j;
+	for (j = 0; j < num_children; j++) {
+		while (children[j]->pc < children[j]->code->size) {
+			run(children[j]);
+		}
+	}
 	dump();
+	instrument_report();
 	return 0;
 }
 
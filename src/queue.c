@@ -2,18 +2,106 @@
 #include <stdlib.h>
 #include "queue.h"
 
+/* Return 1 if the i-th process of [q] must be dequeued before the j-th */
+static int before(struct queue_t * q, int i, int j) {
+	struct pcb_t * a = q->heap[i].proc;
+	struct pcb_t * b = q->heap[j].proc;
+	if (q->order == BY_PRIORITY && a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+	if (q->order == BY_VRUNTIME && a->vruntime != b->vruntime) {
+		return a->vruntime < b->vruntime;
+	}
+	return q->heap[i].seq < q->heap[j].seq;
+}
+
+static void swap(struct queue_t * q, int i, int j) {
+	struct queue_entry_t temp = q->heap[i];
+	q->heap[i] = q->heap[j];
+	q->heap[j] = temp;
+}
+
+void init_queue(struct queue_t * q) {
+	init_queue_by(q, BY_PRIORITY);
+}
+
+void init_queue_by(struct queue_t * q, enum queue_order_t order) {
+	q->heap = NULL;
+	q->size = 0;
+	q->capacity = 0;
+	q->seq = 0;
+	q->order = order;
+}
+
 int empty(struct queue_t * q) {
 	return (q->size == 0);
 }
 
 void enqueue(struct queue_t * q, struct pcb_t * proc) {
 	/* TODO: put a new process to queue [q] */	
-	if(q->size == MAX_QUEUE_SIZE) {
-		printf("Queue is full !\n");
-		return;
+	if(q->size == q->capacity) {
+		q->capacity = q->capacity ? q->capacity * 2 : INIT_QUEUE_SIZE;
+		q->heap = realloc(q->heap, sizeof(*q->heap) * q->capacity);
+		if (q->heap == NULL) {
+			printf("Cannot grow queue to %d processes\n",
+				q->capacity);
+			exit(1);
+		}
+	}
+	int i = q->size++;
+	q->heap[i].proc = proc;
+	q->heap[i].seq = q->seq++;
+	/* Sift up */
+	while (i > 0 && before(q, i, (i - 1) / 2)) {
+		swap(q, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/* Return 1 if the i-th and j-th processes of [q] have the same rank,
+ * i.e. only the order they were put in tells them apart */
+static int tied(struct queue_t * q, int i, int j) {
+	struct pcb_t * a = q->heap[i].proc;
+	struct pcb_t * b = q->heap[j].proc;
+	switch (q->order) {
+	case BY_PRIORITY:
+		return a->priority == b->priority;
+	case BY_VRUNTIME:
+		return a->vruntime == b->vruntime;
+	default:
+		return 1;
+	}
+}
+
+/* Remove the i-th process of [q] */
+static struct pcb_t * remove_at(struct queue_t * q, int i) {
+	struct pcb_t * proc = q->heap[i].proc;
+	q->size--;
+	if (i == q->size) {
+		return proc;
+	}
+	q->heap[i] = q->heap[q->size];
+	/* Sift up */
+	while (i > 0 && before(q, i, (i - 1) / 2)) {
+		swap(q, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	/* Sift down */
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= q->size) {
+			break;
+		}
+		if (child + 1 < q->size && before(q, child + 1, child)) {
+			child++;
+		}
+		if (!before(q, child, i)) {
+			break;
+		}
+		swap(q, i, child);
+		i = child;
 	}
-	q->proc[q->size] = proc;
-	q->size++;
+	return proc;
 }
 
 struct pcb_t * dequeue(struct queue_t * q) {
@@ -23,19 +111,31 @@ struct pcb_t * dequeue(struct queue_t * q) {
 	if(q->size == 0) {
 		return NULL;
 	}
-	int index = 0;
-	struct pcb_t* temp = q->proc[0];
-	for(int i = 1; i < q->size; ++i) {
-		if(temp->priority < q->proc[i]->priority) {
-			temp = q->proc[i];
-			index = i;
+	return remove_at(q, 0);
+}
+
+struct pcb_t * dequeue_affine(struct queue_t * q, int cpu) {
+	if(q->size == 0) {
+		return NULL;
+	}
+	/* Processes tied with the head form a subtree at the top of the
+	 * heap, walk it breadth first */
+	int visit[AFFINITY_WINDOW];
+	int head = 0, tail = 0;
+	visit[tail++] = 0;
+	while (head < tail) {
+		int i = visit[head++];
+		if (q->heap[i].proc->last_cpu == cpu) {
+			return remove_at(q, i);
+		}
+		int child;
+		for (child = 2 * i + 1; child <= 2 * i + 2; child++) {
+			if (child < q->size && tail < AFFINITY_WINDOW
+					&& tied(q, child, 0)) {
+				visit[tail++] = child;
+			}
 		}
 	}
-	
-	q->proc[index] = q->proc[q->size - 1];
-	q->proc[q->size - 1] = NULL;
-	q->size--;
-
-	return temp;
+	return remove_at(q, 0);
 }
 
@@ -1,55 +1,449 @@
 
+#include "instrument.h"
+#include "metrics.h"
 #include "queue.h"
 #include "sched.h"
+#include "timer.h"
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 
-static struct queue_t ready_queue;
-static struct queue_t run_queue;
-static pthread_mutex_t queue_lock;
+/* Why a process is put into a run queue */
+enum enqueue_reason_t {
+	ENQ_NEW,	// Just loaded
+	ENQ_PREEMPTED,	// Used up its time slice
+	ENQ_MIGRATED	// Stolen from the run queue of another CPU
+};
 
-int queue_empty(void) {
-	return (empty(&ready_queue) && empty(&run_queue));
+/* A scheduling policy decides which process of a run queue runs next
+ * and for how long. Every run queue has its own policy state */
+struct policy_t {
+	void * (*create)(void);
+	void (*enqueue)(void * data, struct pcb_t * proc,
+		enum enqueue_reason_t reason);
+	/* Prefer processes which last ran on [cpu] when order allows */
+	struct pcb_t * (*pick)(void * data, int cpu);
+	int (*slice)(void * data, struct pcb_t * proc);
+	/* Account [ran] time slots [proc] just spent on a CPU. May be
+	 * NULL */
+	void (*charge)(void * data, struct pcb_t * proc, uint64_t ran);
+};
+
+/* There is either one run queue shared by every CPU or, in per-CPU
+ * mode, one per CPU. In the latter case a CPU runs processes of its own
+ * queue and only steals from the busiest other queue when its own is
+ * empty. */
+struct runqueue_t {
+	void * data;	// Policy state
+	pthread_mutex_t queue_lock;
+	int nr;		// Number of processes in the queue
+	uint64_t steals;	// Times this CPU stole from another queue
+	uint64_t migrations;	// Processes pulled from other queues
+};
+
+static struct sched_config_t config;
+static const struct policy_t * policy;
+static struct runqueue_t * rq = NULL;
+static int num_rq = 0;
+static int next_rq = 0;	// Where add_proc() starts looking for a queue
+
+/* CPU time of finished processes, for the report at exit */
+static struct {
+	uint32_t pid;
+	uint32_t priority;
+	uint64_t runtime;
+	uint32_t migrations;
+} * finished = NULL;
+static int num_finished = 0;
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Static priority: new processes wait in [ready_queue], preempted ones
+ * in [run_queue] until every process in [ready_queue] has run */
+struct prio_rq_t {
+	struct queue_t ready_queue;
+	struct queue_t run_queue;
+};
+
+static void * prio_create(void) {
+	struct prio_rq_t * q =
+		(struct prio_rq_t*)malloc(sizeof(struct prio_rq_t));
+	init_queue(&q->ready_queue);
+	init_queue(&q->run_queue);
+	return q;
 }
 
-void init_scheduler(void) {
-	ready_queue.size = 0;
-	run_queue.size = 0;
-	for(int i = 0; i < MAX_QUEUE_SIZE; ++i) {
-		ready_queue.proc[i] = NULL;
-		run_queue.proc[i] = NULL;
+static void prio_enqueue(void * data, struct pcb_t * proc,
+		enum enqueue_reason_t reason) {
+	struct prio_rq_t * q = (struct prio_rq_t*)data;
+	if (reason == ENQ_PREEMPTED) {
+		enqueue(&q->run_queue, proc);
+	}else{
+		enqueue(&q->ready_queue, proc);
 	}
-	pthread_mutex_init(&queue_lock, NULL);
 }
 
-struct pcb_t * get_proc(void) {
-	struct pcb_t * proc = NULL;
+static struct pcb_t * prio_pick(void * data, int cpu) {
+	struct prio_rq_t * q = (struct prio_rq_t*)data;
 	/*TODO: get a process from [ready_queue]. If ready queue
 	 * is empty, push all processes in [run_queue] back to
 	 * [ready_queue] and return the highest priority one.
-	 * Remember to use lock to protect the queue.
 	 * */
-	pthread_mutex_lock(&queue_lock);
-	if(empty(&ready_queue)) {
-		while(!empty(&run_queue)) {
-			enqueue(&ready_queue, dequeue(&run_queue));
+	if(empty(&q->ready_queue)) {
+		/* Moving everything keeps the order of the run queue, so
+		 * just exchange the two queues */
+		struct queue_t temp = q->ready_queue;
+		q->ready_queue = q->run_queue;
+		q->run_queue = temp;
+	}
+	return dequeue_affine(&q->ready_queue, cpu);
+}
+
+static int prio_slice(void * data, struct pcb_t * proc) {
+	return config.time_slot;
+}
+
+static const struct policy_t prio_policy = {
+	prio_create, prio_enqueue, prio_pick, prio_slice, NULL
+};
+
+/* Multilevel feedback queue: one FIFO queue per level, lower levels
+ * run first and get shorter quanta */
+struct mlfq_rq_t {
+	struct queue_t level[MLFQ_MAX_LEVELS];
+	uint64_t last_boost;
+};
+
+static void * mlfq_create(void) {
+	struct mlfq_rq_t * q =
+		(struct mlfq_rq_t*)malloc(sizeof(struct mlfq_rq_t));
+	int i;
+	for (i = 0; i < config.mlfq_levels; i++) {
+		init_queue_by(&q->level[i], BY_ARRIVAL);
+	}
+	q->last_boost = 0;
+	return q;
+}
+
+static void mlfq_enqueue(void * data, struct pcb_t * proc,
+		enum enqueue_reason_t reason) {
+	struct mlfq_rq_t * q = (struct mlfq_rq_t*)data;
+	if (reason == ENQ_NEW) {
+		proc->level = 0;
+	}else if (reason == ENQ_PREEMPTED
+			&& proc->level + 1 < config.mlfq_levels) {
+		proc->level++;
+	}
+	enqueue(&q->level[proc->level], proc);
+}
+
+static struct pcb_t * mlfq_pick(void * data, int cpu) {
+	struct mlfq_rq_t * q = (struct mlfq_rq_t*)data;
+	uint64_t now = current_time();
+	int i;
+	if (config.mlfq_boost > 0 && now - q->last_boost >= config.mlfq_boost) {
+		/* Give processes starved in lower levels a chance again */
+		for (i = 1; i < config.mlfq_levels; i++) {
+			struct pcb_t * proc;
+			while ((proc = dequeue(&q->level[i])) != NULL) {
+				proc->level = 0;
+				enqueue(&q->level[0], proc);
+			}
+		}
+		q->last_boost = now;
+	}
+	for (i = 0; i < config.mlfq_levels; i++) {
+		if (!empty(&q->level[i])) {
+			return dequeue_affine(&q->level[i], cpu);
 		}
 	}
-	proc = dequeue(&ready_queue);
-	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
 
+static int mlfq_slice(void * data, struct pcb_t * proc) {
+	return config.mlfq_quantum[proc->level];
+}
+
+static const struct policy_t mlfq_policy = {
+	mlfq_create, mlfq_enqueue, mlfq_pick, mlfq_slice, NULL
+};
+
+/* Completely fair: the process which has the lowest virtual runtime
+ * runs next. Virtual runtime grows by CFS_SCALE / weight per time slot
+ * on a CPU, so heavier processes get a proportionally larger share */
+#define CFS_SCALE	1024
+#define CFS_WEIGHT(proc)	((uint64_t)(proc)->priority + 1)
+
+struct cfs_rq_t {
+	struct queue_t tasks;
+	uint64_t min_vruntime;	// Never decreases
+	uint64_t total_weight;	// Of the queued processes
+};
+
+static void * cfs_create(void) {
+	struct cfs_rq_t * q =
+		(struct cfs_rq_t*)malloc(sizeof(struct cfs_rq_t));
+	init_queue_by(&q->tasks, BY_VRUNTIME);
+	q->min_vruntime = 0;
+	q->total_weight = 0;
+	return q;
+}
+
+static void cfs_enqueue(void * data, struct pcb_t * proc,
+		enum enqueue_reason_t reason) {
+	struct cfs_rq_t * q = (struct cfs_rq_t*)data;
+	/* Newcomers must not starve the others by starting far behind */
+	if (reason != ENQ_PREEMPTED && proc->vruntime < q->min_vruntime) {
+		proc->vruntime = q->min_vruntime;
+	}
+	enqueue(&q->tasks, proc);
+	q->total_weight += CFS_WEIGHT(proc);
+}
+
+static struct pcb_t * cfs_pick(void * data, int cpu) {
+	struct cfs_rq_t * q = (struct cfs_rq_t*)data;
+	struct pcb_t * proc = dequeue_affine(&q->tasks, cpu);
+	if (proc != NULL) {
+		q->total_weight -= CFS_WEIGHT(proc);
+		if (proc->vruntime > q->min_vruntime) {
+			q->min_vruntime = proc->vruntime;
+		}
+	}
 	return proc;
 }
 
-void put_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&run_queue, proc);
-	pthread_mutex_unlock(&queue_lock);
+static int cfs_slice(void * data, struct pcb_t * proc) {
+	struct cfs_rq_t * q = (struct cfs_rq_t*)data;
+	uint64_t weight = CFS_WEIGHT(proc);
+	int slice = config.cfs_latency * weight / (q->total_weight + weight);
+	return slice < config.cfs_granularity ? config.cfs_granularity : slice;
+}
+
+static void cfs_charge(void * data, struct pcb_t * proc, uint64_t ran) {
+	proc->vruntime += ran * CFS_SCALE / CFS_WEIGHT(proc);
+}
+
+static const struct policy_t cfs_policy = {
+	cfs_create, cfs_enqueue, cfs_pick, cfs_slice, cfs_charge
+};
+
+int queue_empty(void) {
+	int i;
+	for (i = 0; i < num_rq; i++) {
+		if (__atomic_load_n(&rq[i].nr, __ATOMIC_RELAXED) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void init_scheduler(struct sched_config_t * cfg) {
+	config = *cfg;
+	switch (config.policy) {
+	case SCHED_MLFQ:
+		policy = &mlfq_policy;
+		break;
+	case SCHED_CFS:
+		policy = &cfs_policy;
+		break;
+	default:
+		policy = &prio_policy;
+	}
+	num_rq = config.per_cpu ? config.num_cpus : 1;
+	rq = (struct runqueue_t*)calloc(num_rq, sizeof(struct runqueue_t));
+	int i;
+	for (i = 0; i < num_rq; i++) {
+		rq[i].data = policy->create();
+		pthread_mutex_init(&rq[i].queue_lock, NULL);
+	}
+}
+
+/* Put [proc] into [q]. Caller must hold its lock */
+static void rq_enqueue(struct runqueue_t * q, struct pcb_t * proc,
+		enum enqueue_reason_t reason) {
+	policy->enqueue(q->data, proc, reason);
+	__atomic_store_n(&q->nr, q->nr + 1, __ATOMIC_RELAXED);
+}
+
+/* Take the next process out of [q] for CPU [cpu]. Caller must hold
+ * its lock */
+static struct pcb_t * rq_pick(struct runqueue_t * q, int cpu) {
+	struct pcb_t * proc = policy->pick(q->data, cpu);
+	if (proc != NULL) {
+		__atomic_store_n(&q->nr, q->nr - 1, __ATOMIC_RELAXED);
+	}
+	return proc;
+}
+
+/* Move half of the processes of the busiest other queue to the queue of
+ * CPU [cpu] and return one of them to run. Return NULL if every other
+ * queue is empty, or if waiting there is cheaper than migrating */
+static struct pcb_t * steal(int cpu) {
+	struct runqueue_t * victim = NULL;
+	int busiest = 0;
+	int i;
+	for (i = 0; i < num_rq; i++) {
+		int nr = __atomic_load_n(&rq[i].nr, __ATOMIC_RELAXED);
+		if (i != cpu && nr > busiest) {
+			busiest = nr;
+			victim = &rq[i];
+		}
+	}
+	/* A process stolen from a queue of [busiest] processes would have
+	 * waited about [busiest] time slices there */
+	if (victim == NULL || (uint64_t)busiest * config.time_slot
+			<= config.migration_cost) {
+		return NULL;
+	}
+
+	struct pcb_t ** moved =
+		(struct pcb_t**)malloc(sizeof(struct pcb_t*) * busiest);
+	int num_moved = 0;
+	LOCK(&victim->queue_lock, LOCK_QUEUE);
+	int want = (victim->nr + 1) / 2;
+	while (num_moved < want && num_moved < busiest) {
+		moved[num_moved++] = rq_pick(victim, cpu);
+	}
+	UNLOCK(&victim->queue_lock, LOCK_QUEUE);
+
+	struct pcb_t * proc = NULL;
+	struct runqueue_t * q = &rq[cpu];
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	if (num_moved > 0) {
+		q->steals++;
+		q->migrations += num_moved;
+		proc = moved[0];
+		for (i = 1; i < num_moved; i++) {
+			rq_enqueue(q, moved[i], ENQ_MIGRATED);
+		}
+	}
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);
+	free(moved);
+	return proc;
+}
+
+struct pcb_t * get_proc(int cpu) {
+	struct pcb_t * proc = NULL;
+	struct runqueue_t * q = &rq[cpu % num_rq];
+	/* Remember to use lock to protect the queue */
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	proc = rq_pick(q, cpu);
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);
+
+	if (proc == NULL && num_rq > 1) {
+		proc = steal(cpu);
+	}
+	if (proc != NULL) {
+		proc->dispatch_time = current_time();
+		metrics_dispatch(proc, cpu);
+	}
+	return proc;
+}
+
+int dispatch_penalty(struct pcb_t * proc, int cpu) {
+	int penalty = 0;
+	if (proc->last_cpu >= 0 && proc->last_cpu != cpu) {
+		proc->migrations++;
+		penalty = config.migration_cost;
+		/* It only starts running after the stall, which must not be
+		 * charged to it nor count as CPU busy time */
+		proc->dispatch_time += penalty;
+	}
+	proc->last_cpu = cpu;
+	return penalty;
+}
+
+int time_slice(struct pcb_t * proc, int cpu) {
+	struct runqueue_t * q = &rq[cpu % num_rq];
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	int slice = policy->slice(q->data, proc);
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);
+	return slice;
+}
+
+/* Account the time [proc] spent on the CPU since its dispatch. Caller
+ * must hold the lock of [q] */
+static void charge(struct runqueue_t * q, struct pcb_t * proc) {
+	uint64_t ran = current_time() - proc->dispatch_time;
+	proc->runtime += ran;
+	if (policy->charge != NULL) {
+		policy->charge(q->data, proc, ran);
+	}
+}
+
+void put_proc(struct pcb_t * proc, int cpu) {
+	struct runqueue_t * q = &rq[cpu % num_rq];
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	charge(q, proc);
+	/* Once queued, another CPU may dispatch [proc] again */
+	metrics_leave(proc, cpu, 0);
+	rq_enqueue(q, proc, ENQ_PREEMPTED);
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);
+}
+
+void finish_proc(struct pcb_t * proc, int cpu) {
+	struct runqueue_t * q = &rq[cpu % num_rq];
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	charge(q, proc);
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);
+	metrics_leave(proc, cpu, 1);
+
+	pthread_mutex_lock(&finished_lock);
+	finished = realloc(finished, sizeof(*finished) * (num_finished + 1));
+	finished[num_finished].pid = proc->pid;
+	finished[num_finished].priority = proc->priority;
+	finished[num_finished].runtime = proc->runtime;
+	finished[num_finished].migrations = proc->migrations;
+	num_finished++;
+	pthread_mutex_unlock(&finished_lock);
 }
 
 void add_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&ready_queue, proc);
-	pthread_mutex_unlock(&queue_lock);	
+	/* Spread new processes over the queues: pick the least loaded
+	 * one, starting after the queue chosen last time. Both the loader
+	 * and CPUs running FORK get here, so next_rq is accessed atomically;
+	 * a stale hint only affects the spread, not correctness */
+	int start = __atomic_load_n(&next_rq, __ATOMIC_RELAXED);
+	int target = start;
+	int i;
+	for (i = 0; i < num_rq; i++) {
+		int j = (start + i) % num_rq;
+		if (__atomic_load_n(&rq[j].nr, __ATOMIC_RELAXED)
+				< __atomic_load_n(&rq[target].nr,
+					__ATOMIC_RELAXED)) {
+			target = j;
+		}
+	}
+	__atomic_store_n(&next_rq, (target + 1) % num_rq, __ATOMIC_RELAXED);
+
+	metrics_arrive(proc);
+	struct runqueue_t * q = &rq[target];
+	LOCK(&q->queue_lock, LOCK_QUEUE);
+	rq_enqueue(q, proc, ENQ_NEW);
+	UNLOCK(&q->queue_lock, LOCK_QUEUE);	
 }
 
+void finish_scheduler(void) {
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < num_finished; i++) {
+		total += finished[i].runtime;
+	}
+	fprintf(stderr, "CPU share:\n");
+	for (i = 0; i < num_finished; i++) {
+		fprintf(stderr, "\tPID %2d (priority %2d): %3lu slots, %5.1f%%, "
+			"%u migrations\n",
+			finished[i].pid, finished[i].priority,
+			finished[i].runtime,
+			total ? 100.0 * finished[i].runtime / total : 0.0,
+			finished[i].migrations);
+	}
+	if (num_rq > 1) {
+		fprintf(stderr, "Run queues:\n");
+		for (i = 0; i < num_rq; i++) {
+			fprintf(stderr, "\tCPU %d: %lu steals, "
+				"%lu processes migrated in\n",
+				i, rq[i].steals, rq[i].migrations);
+		}
+	}
+}
 
@@ -1,9 +1,27 @@
 
 #include "timer.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
-
-static pthread_t _timer;
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Time slots are separated by a barrier that every attached device
+ * reaches by calling next_slot(), idle_slot() or sleep_until(). The
+ * last device to arrive acts as the timer: it moves to the next slot and
+ * releases the others by bumping [_phase]. Waiting devices spin briefly
+ * and then sleep, so a slot costs one atomic add per device plus a
+ * single wake-up, however many devices there are.
+ *
+ * A device in sleep_until() keeps counting as arrived until its slot
+ * comes, and only it is woken then. If no device was busy in a slot,
+ * nothing can happen before the earliest sleeping device wakes up, so
+ * time jumps there in one step. */
+
+#define SPIN_LIMIT	200
 
 struct timer_id_container_t {
 	struct timer_id_t id;
@@ -15,65 +33,159 @@ static struct timer_id_container_t * dev_list = NULL;
 static uint64_t _time;
 
 static int timer_started = 0;
-static int timer_stop = 0;
-
 
-static void * timer_routine(void * args) {
-	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
-		/* Wait for all devices have done the job in current
-		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
+/* Number of attached devices in the upper half, devices which arrived
+ * in the current slot in the lower half. Keeping both in one word lets
+ * a single atomic operation tell whether it completes the slot */
+#define DEVICE_ONE	(1ULL << 32)
+#define ARRIVED(x)	((x) & 0xffffffffULL)
+#define DEVICES(x)	((x) >> 32)
+static uint64_t _barrier = 0;
+
+static int _busy = 0;		// Devices which arrived by next_slot()
+static int _sleeping = 0;	// Devices in sleep_until()
+static struct timer_id_t ** _wake_list;	// Sleepers released in a slot
+
+static uint32_t _phase = 0;	// Number of completed slots
+static int _blocked = 0;	// Devices sleeping in wait_word()
+
+static int _finished = 0;	// Every device has detached
+static pthread_mutex_t _phase_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _stop_cond = PTHREAD_COND_INITIALIZER;
+#ifndef __linux__
+static pthread_cond_t _phase_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+/* Block until [*word] is no longer [value] */
+static void wait_word(uint32_t * word, uint32_t value) {
+	int i;
+	for (i = 0; i < SPIN_LIMIT; i++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value) {
+			return;
 		}
+	}
+	__atomic_add_fetch(&_blocked, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value) {
+		syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value,
+			NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_lock(&_phase_lock);
+	while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+		pthread_cond_wait(&_phase_cond, &_phase_lock);
+	}
+	pthread_mutex_unlock(&_phase_lock);
+#endif
+	__atomic_sub_fetch(&_blocked, 1, __ATOMIC_RELAXED);
+}
 
-		/* Increase the time slot */
+/* Bump [*word] and wake up everybody waiting on it */
+static void wake_word(uint32_t * word) {
+#ifdef __linux__
+	__atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_blocked, __ATOMIC_SEQ_CST) > 0) {
+		syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT32_MAX,
+			NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_lock(&_phase_lock);
+	__atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&_phase_cond);
+	pthread_mutex_unlock(&_phase_lock);
+#endif
+}
+
+/* Called by the device whose arrival or detachment completes the
+ * current slot, every other device is waiting */
+static void complete_slot(uint64_t state) {
+	struct timer_id_container_t * temp;
+	if (DEVICES(state) == 0) {
+		/* Every device has finished, wake up stop_timer() */
 		_time++;
-		
-		/* Let devices continue their job */
+		pthread_mutex_lock(&_phase_lock);
+		_finished = 1;
+		pthread_cond_broadcast(&_stop_cond);
+		pthread_mutex_unlock(&_phase_lock);
+		return;
+	}
+
+	/* Increase the time slot, or skip to the earliest wake-up if
+	 * nobody has work to do before */
+	uint64_t next = _time + 1;
+	if (_busy == 0 && _sleeping > 0) {
+		next = UINT64_MAX;
 		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
+			if (temp->id.resume != 0 && temp->id.resume < next) {
+				next = temp->id.resume;
+			}
 		}
-		if (fsh == event) {
-			break;
+	}
+	trace_slots(_time + 1, next);
+	_time = next;
+	_busy = 0;
+
+	/* Sleeping devices whose slot has come are released, the others
+	 * stay arrived for the next slot. Nobody may run before the new
+	 * barrier state is published */
+	uint64_t still = 0;
+	int num_wake = 0;
+	if (_sleeping > 0) {
+		for (temp = dev_list; temp != NULL; temp = temp->next) {
+			if (temp->id.resume == 0) {
+				continue;
+			}
+			if (temp->id.resume <= _time) {
+				temp->id.resume = 0;
+				_sleeping--;
+				_wake_list[num_wake++] = &temp->id;
+			}else{
+				still++;
+			}
 		}
 	}
-	pthread_exit(args);
+	__atomic_store_n(&_barrier, state - ARRIVED(state) + still,
+		__ATOMIC_RELEASE);
+
+	/* Let devices continue their job. The new phase must be out
+	 * before any sleeper runs, or its next arrival could read the old
+	 * one and count twice in the slot */
+	wake_word(&_phase);
+	int i;
+	for (i = 0; i < num_wake; i++) {
+		wake_word(&_wake_list[i]->wake);
+	}
+}
+
+/* Count the calling device as arrived in the current slot */
+static void arrive(uint32_t * word) {
+	/* The slot cannot end before we arrive, and [*word] was last
+	 * bumped before we were released from the previous one, so it is
+	 * current */
+	uint32_t value = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+	uint64_t state = __atomic_add_fetch(&_barrier, 1, __ATOMIC_ACQ_REL);
+	if (ARRIVED(state) == DEVICES(state)) {
+		complete_slot(state);
+	}
+	wait_word(word, value);
 }
 
 void next_slot(struct timer_id_t * timer_id) {
-	/* Tell to timer that we have done our job in current slot */
-	pthread_mutex_lock(&timer_id->event_lock);
-	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
-
-	/* Wait for going to next slot */
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+	__atomic_add_fetch(&_busy, 1, __ATOMIC_RELAXED);
+	arrive(&_phase);
+}
+
+void idle_slot(struct timer_id_t * timer_id) {
+	arrive(&_phase);
+}
+
+void sleep_until(struct timer_id_t * timer_id, uint64_t time) {
+	if (time <= current_time()) {
+		return;
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+	timer_id->resume = time;
+	__atomic_add_fetch(&_sleeping, 1, __ATOMIC_RELAXED);
+	arrive(&timer_id->wake);
 }
 
 uint64_t current_time() {
@@ -82,14 +194,19 @@ uint64_t current_time() {
 
 void start_timer() {
 	timer_started = 1;
-	pthread_create(&_timer, NULL, timer_routine, NULL);
+	_wake_list = (struct timer_id_t**)malloc(
+		sizeof(struct timer_id_t*) * DEVICES(_barrier));
+	trace_slots(0, 0);
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+	uint64_t state = __atomic_sub_fetch(&_barrier, DEVICE_ONE,
+		__ATOMIC_ACQ_REL);
+	if (ARRIVED(state) == DEVICES(state)) {
+		/* Everybody else was waiting for us */
+		complete_slot(state);
+	}
 }
 
 struct timer_id_t * attach_event() {
@@ -97,15 +214,10 @@ struct timer_id_t * attach_event() {
 		return NULL;
 	}else{
 		struct timer_id_container_t * container =
-			(struct timer_id_container_t*)malloc(
+			(struct timer_id_container_t*)calloc(1,
 				sizeof(struct timer_id_container_t)		
 			);
-		container->id.done = 0;
-		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, NULL);
-		pthread_mutex_init(&container->id.event_lock, NULL);
-		pthread_cond_init(&container->id.timer_cond, NULL);
-		pthread_mutex_init(&container->id.timer_lock, NULL);
+		_barrier += DEVICE_ONE;
 		if (dev_list == NULL) {
 			dev_list = container;
 			dev_list->next = NULL;
@@ -118,19 +230,16 @@ struct timer_id_t * attach_event() {
 }
 
 void stop_timer() {
-	timer_stop = 1;
-	pthread_join(_timer, NULL);
+	/* Wait for all devices to detach */
+	pthread_mutex_lock(&_phase_lock);
+	while (!_finished) {
+		pthread_cond_wait(&_stop_cond, &_phase_lock);
+	}
+	pthread_mutex_unlock(&_phase_lock);
+	free(_wake_list);
 	while (dev_list != NULL) {
 		struct timer_id_container_t * temp = dev_list;
 		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
 		free(temp);
 	}
 }
-
-
-
-
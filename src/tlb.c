@@ -0,0 +1,187 @@
+
+#include "tlb.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A set-associative TLB owned by one CPU thread. Other threads only
+ * touch it to shoot down stale entries, so [lock] is almost never
+ * contended */
+struct tlb_t {
+	int cpu;
+	struct {
+		uint32_t pid;	// 0 if the entry is empty
+		addr_t vpn;
+		addr_t frame;
+		int writable;
+		uint32_t stamp;	// Last use, for LRU replacement in the set
+	} * entry;
+	uint32_t clock;
+	uint64_t hits;
+	uint64_t misses;
+	pthread_mutex_t lock;
+	struct tlb_t * next;
+};
+
+static int _sets = TLB_DEFAULT_ENTRIES / TLB_DEFAULT_WAYS;
+static int _ways = TLB_DEFAULT_WAYS;
+
+/* All TLBs, newest first. Nodes are never removed and only pushed
+ * under [_list_lock], so readers may walk the list without locking */
+static struct tlb_t * _tlb_list = NULL;
+static pthread_mutex_t _list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct tlb_t * _tlb = NULL;
+
+void init_tlb(int entries, int ways) {
+	if (entries == 0) {
+		_sets = 0;
+		return;
+	}
+	if (ways <= 0 || entries % ways != 0
+			|| ((entries / ways) & (entries / ways - 1)) != 0) {
+		printf("Invalid TLB geometry: %d entries, %d ways\n",
+			entries, ways);
+		exit(1);
+	}
+	_sets = entries / ways;
+	_ways = ways;
+}
+
+void tlb_attach(int cpu) {
+	if (_sets == 0) {
+		return;
+	}
+	struct tlb_t * tlb = (struct tlb_t*)calloc(1, sizeof(struct tlb_t));
+	tlb->cpu = cpu;
+	tlb->entry = calloc(_sets * _ways, sizeof(*tlb->entry));
+	pthread_mutex_init(&tlb->lock, NULL);
+
+	pthread_mutex_lock(&_list_lock);
+	tlb->next = _tlb_list;
+	__atomic_store_n(&_tlb_list, tlb, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_list_lock);
+	_tlb = tlb;
+}
+
+/* First entry of the set [vpn] of process [pid] maps to */
+static int set_base(uint32_t pid, addr_t vpn) {
+	return ((vpn ^ (pid * 0x9e3779b1U)) & (_sets - 1)) * _ways;
+}
+
+int tlb_lookup(uint32_t pid, addr_t vpn, addr_t * frame, int write) {
+	struct tlb_t * tlb = _tlb;
+	if (tlb == NULL) {
+		return 0;
+	}
+	int base = set_base(pid, vpn);
+	int i;
+	pthread_mutex_lock(&tlb->lock);
+	for (i = base; i < base + _ways; i++) {
+		if (tlb->entry[i].pid == pid && tlb->entry[i].vpn == vpn
+				&& (tlb->entry[i].writable || !write)) {
+			tlb->entry[i].stamp = ++tlb->clock;
+			*frame = tlb->entry[i].frame;
+			tlb->hits++;
+			pthread_mutex_unlock(&tlb->lock);
+			return 1;
+		}
+	}
+	tlb->misses++;
+	pthread_mutex_unlock(&tlb->lock);
+	return 0;
+}
+
+void tlb_insert(uint32_t pid, addr_t vpn, addr_t frame, int writable) {
+	struct tlb_t * tlb = _tlb;
+	if (tlb == NULL) {
+		return;
+	}
+	int base = set_base(pid, vpn);
+	int victim = base;
+	int i;
+	pthread_mutex_lock(&tlb->lock);
+	/* Update the entry of [vpn] if there is one, or take the first empty
+	 * entry, or the least recently used one */
+	for (i = base; i < base + _ways; i++) {
+		if (tlb->entry[i].pid == pid && tlb->entry[i].vpn == vpn) {
+			victim = i;
+			break;
+		}
+		if (tlb->entry[victim].pid == 0) {
+			continue;
+		}
+		if (tlb->entry[i].pid == 0) {
+			victim = i;
+			continue;
+		}
+		if (tlb->entry[i].stamp < tlb->entry[victim].stamp) {
+			victim = i;
+		}
+	}
+	tlb->entry[victim].pid = pid;
+	tlb->entry[victim].vpn = vpn;
+	tlb->entry[victim].frame = frame;
+	tlb->entry[victim].writable = writable;
+	tlb->entry[victim].stamp = ++tlb->clock;
+	pthread_mutex_unlock(&tlb->lock);
+}
+
+void tlb_invalidate(uint32_t pid, addr_t vpn) {
+	struct tlb_t * tlb = __atomic_load_n(&_tlb_list, __ATOMIC_ACQUIRE);
+	int base = set_base(pid, vpn);
+	for (; tlb != NULL; tlb = tlb->next) {
+		int i;
+		pthread_mutex_lock(&tlb->lock);
+		for (i = base; i < base + _ways; i++) {
+			if (tlb->entry[i].pid == pid
+					&& tlb->entry[i].vpn == vpn) {
+				tlb->entry[i].pid = 0;
+			}
+		}
+		pthread_mutex_unlock(&tlb->lock);
+	}
+}
+
+void tlb_flush(uint32_t pid) {
+	struct tlb_t * tlb = __atomic_load_n(&_tlb_list, __ATOMIC_ACQUIRE);
+	for (; tlb != NULL; tlb = tlb->next) {
+		int i;
+		pthread_mutex_lock(&tlb->lock);
+		for (i = 0; i < _sets * _ways; i++) {
+			if (tlb->entry[i].pid == pid) {
+				tlb->entry[i].pid = 0;
+			}
+		}
+		pthread_mutex_unlock(&tlb->lock);
+	}
+}
+
+void tlb_report(void) {
+	struct tlb_t * head = __atomic_load_n(&_tlb_list, __ATOMIC_ACQUIRE);
+	if (head == NULL) {
+		return;
+	}
+	fprintf(stderr, "TLB: %d entries, %d-way\n", _sets * _ways, _ways);
+	/* The list is newest first, print CPUs in ascending order instead */
+	int cpu = -1;
+	while (1) {
+		struct tlb_t * tlb;
+		struct tlb_t * next = NULL;
+		for (tlb = head; tlb != NULL; tlb = tlb->next) {
+			if (tlb->cpu > cpu
+					&& (next == NULL || tlb->cpu < next->cpu)) {
+				next = tlb;
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		uint64_t total = next->hits + next->misses;
+		fprintf(stderr, "\tCPU %d: %lu hits, %lu misses (%.1f%% hit)\n",
+			next->cpu, next->hits, next->misses,
+			total ? 100.0 * next->hits / total : 0.0);
+		cpu = next->cpu;
+	}
+}
+
@@ -0,0 +1,204 @@
+
+#include "trace.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Every thread writes its records to a single-producer ring, taking a
+ * number from the global sequence [_seq] for each. A thread has written
+ * all its records of a slot before it arrives at the slot barrier, so
+ * once the record of a new slot is out, no record with a smaller
+ * sequence number can show up any more. The drain thread merges the
+ * rings by sequence number up to the latest such record [_safe] */
+
+#define RING_SIZE	4096
+#define DRAIN_NAP	1000000	// Nanoseconds to sleep when rings are empty
+
+struct trace_ring_t {
+	struct trace_rec_t rec[RING_SIZE];
+	uint64_t head;	// Next record to drain, moved by the drain thread
+	uint64_t tail;	// Next free record, moved by the owner
+	struct trace_ring_t * next;
+};
+
+/* All rings, newest first. Nodes are only pushed, under [_ring_lock] */
+static struct trace_ring_t * _ring_list = NULL;
+static pthread_mutex_t _ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring_t * _ring = NULL;
+
+static uint64_t _seq = 0;
+static uint64_t _safe = 0;	// Records up to this number are written
+static int _stopping = 0;
+
+static FILE * _out;
+static int _binary = 0;
+static pthread_t _drain;
+
+static void emit(const struct trace_rec_t * rec) {
+	if (_binary) {
+		struct trace_rec_t copy = *rec;
+		const char * path = (const char *)(uintptr_t)rec->arg;
+		if (rec->type == TRACE_LOAD) {
+			copy.arg = strlen(path);
+		}
+		fwrite(&copy, sizeof(copy), 1, _out);
+		if (rec->type == TRACE_LOAD) {
+			fwrite(path, 1, copy.arg, _out);
+		}
+		return;
+	}
+	uint64_t t;
+	switch (rec->type) {
+	case TRACE_SLOT:
+		for (t = rec->time; t <= rec->arg; t++) {
+			fprintf(_out, "Time slot %3lu\n", t);
+		}
+		break;
+	case TRACE_LOAD:
+		fprintf(_out, "\tLoaded a process at %s, PID: %d\n",
+			(const char *)(uintptr_t)rec->arg, rec->pid);
+		break;
+	case TRACE_DISPATCH:
+		fprintf(_out, "\tCPU %d: Dispatched process %2d\n",
+			rec->cpu, rec->pid);
+		break;
+	case TRACE_PUT:
+		fprintf(_out, "\tCPU %d: Put process %2d to run queue\n",
+			rec->cpu, rec->pid);
+		break;
+	case TRACE_FINISH:
+		fprintf(_out, "\tCPU %d: Processed %2d has finished\n",
+			rec->cpu, rec->pid);
+		break;
+	case TRACE_STOP:
+		fprintf(_out, "\tCPU %d stopped\n", rec->cpu);
+		break;
+	case TRACE_FORK:
+		fprintf(_out, "\tCPU %d: Process %2d forked process %2lu\n",
+			rec->cpu, rec->pid, rec->arg);
+		break;
+	}
+}
+
+/* Write out records numbered up to [safe] in order. Return how many */
+static int drain(uint64_t safe) {
+	int count = 0;
+	while (1) {
+		struct trace_ring_t * ring, * best = NULL;
+		uint64_t best_seq = 0;
+		for (ring = __atomic_load_n(&_ring_list, __ATOMIC_ACQUIRE);
+				ring != NULL; ring = ring->next) {
+			uint64_t head = ring->head;
+			if (head == __atomic_load_n(&ring->tail,
+					__ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			uint64_t seq = ring->rec[head % RING_SIZE].seq;
+			if (seq <= safe && (best == NULL || seq < best_seq)) {
+				best = ring;
+				best_seq = seq;
+			}
+		}
+		if (best == NULL) {
+			return count;
+		}
+		emit(&best->rec[best->head % RING_SIZE]);
+		__atomic_store_n(&best->head, best->head + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+}
+
+static void * drain_routine(void * args) {
+	struct timespec nap = {0, DRAIN_NAP};
+	while (1) {
+		int stopping = __atomic_load_n(&_stopping, __ATOMIC_ACQUIRE);
+		uint64_t safe = stopping ? UINT64_MAX
+			: __atomic_load_n(&_safe, __ATOMIC_ACQUIRE);
+		int count = drain(safe);
+		if (stopping) {
+			break;
+		}
+		if (count == 0) {
+			nanosleep(&nap, NULL);
+		}
+	}
+	return NULL;
+}
+
+/* Append a record to the ring of the calling thread. Return its
+ * sequence number */
+static uint64_t append(enum trace_type_t type, uint64_t time, uint64_t arg,
+		int cpu, uint32_t pid) {
+	struct trace_ring_t * ring = _ring;
+	if (ring == NULL) {
+		ring = (struct trace_ring_t*)calloc(1,
+			sizeof(struct trace_ring_t));
+		pthread_mutex_lock(&_ring_lock);
+		ring->next = _ring_list;
+		__atomic_store_n(&_ring_list, ring, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&_ring_lock);
+		_ring = ring;
+	}
+	/* A thread only writes a few records per slot, so the drain thread
+	 * is never waiting on a full ring */
+	struct timespec nap = {0, DRAIN_NAP};
+	while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+			== RING_SIZE) {
+		nanosleep(&nap, NULL);
+	}
+	struct trace_rec_t * rec = &ring->rec[ring->tail % RING_SIZE];
+	rec->seq = __atomic_fetch_add(&_seq, 1, __ATOMIC_RELAXED);
+	rec->time = time;
+	rec->arg = arg;
+	rec->pid = pid;
+	rec->cpu = cpu;
+	rec->type = type;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	return rec->seq;
+}
+
+void start_trace(const char * path) {
+	if (path != NULL) {
+		if ((_out = fopen(path, "wb")) == NULL) {
+			printf("Cannot create trace file at %s\n", path);
+			exit(1);
+		}
+		_binary = 1;
+		struct trace_file_header_t header = {TRACE_MAGIC, TRACE_VERSION};
+		fwrite(&header, sizeof(header), 1, _out);
+	}else{
+		_out = stdout;
+	}
+	pthread_create(&_drain, NULL, drain_routine, NULL);
+}
+
+void stop_trace(void) {
+	__atomic_store_n(&_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(_drain, NULL);
+	if (_binary) {
+		fclose(_out);
+	}else{
+		fflush(_out);
+	}
+}
+
+void trace_slots(uint64_t first, uint64_t last) {
+	uint64_t seq = append(TRACE_SLOT, first, last, 0, 0);
+	__atomic_store_n(&_safe, seq, __ATOMIC_RELEASE);
+}
+
+void trace_event(enum trace_type_t type, int cpu, uint32_t pid) {
+	append(type, current_time(), 0, cpu, pid);
+}
+
+void trace_fork(int cpu, uint32_t pid, uint32_t child) {
+	append(TRACE_FORK, current_time(), child, cpu, pid);
+}
+
+void trace_load(uint32_t pid, const char * path) {
+	append(TRACE_LOAD, current_time(), (uintptr_t)path, 0, pid);
+}
+